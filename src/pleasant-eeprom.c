@@ -0,0 +1,125 @@
+#include <stddef.h>
+#include <util/delay.h>
+#include "pleasant-eeprom.h"
+
+#if !TWI_MASTER
+#error "Pleasant EEPROM needs TWI_MASTER"
+#endif
+
+#define EEPROM_MAX_ADDRESS_BYTES 2
+
+/* A failed attempt itself takes some time as well, so this is on the long
+   side. */
+#define EEPROM_POLL_LIMIT                                                     \
+  (EEPROM_POLL_TIMEOUT_MS * 1000UL / EEPROM_POLL_INTERVAL_US)
+
+/* Page writes send the memory address and the data in a single segment, so
+   they are put together in this buffer. */
+static uint8_t eeprom_page_buffer[EEPROM_MAX_ADDRESS_BYTES
+                                  + EEPROM_MAX_PAGE_SIZE];
+
+/* Devices with a single address byte take the upper bits of the memory
+   address in their TWI address. */
+static uint8_t eeprom_device_address(const struct eeprom *eeprom,
+                                     uint16_t address) {
+  if (eeprom->address_bytes == 1) return eeprom->address | (address >> 8);
+  return eeprom->address;
+}
+
+/* Store the memory address at the start of buffer, returning its length. */
+static uint8_t eeprom_put_address(const struct eeprom *eeprom,
+                                  uint16_t address,
+                                  uint8_t *buffer) {
+  if (eeprom->address_bytes == 1) {
+    buffer[0] = address;
+    return 1;
+  }
+
+  buffer[0] = address >> 8;
+  buffer[1] = address;
+  return 2;
+}
+
+/* Perform a transaction, retrying it while the device is busy. */
+static bool eeprom_transfer(const struct twi_segment *segments,
+                            uint8_t count,
+                            enum twi_error *error) {
+  uint16_t attempts;
+
+  for (attempts = 0; attempts < EEPROM_POLL_LIMIT; attempts++) {
+    twi_transfer(segments, count, error);
+    if (*error != TWI_ERROR_MASTER_START_REJECTED) break;
+    _delay_us(EEPROM_POLL_INTERVAL_US);
+  }
+
+  return *error == TWI_ERROR_NONE;
+}
+
+/* API functions ----------------------------------------------------------- */
+
+bool eeprom_write(const struct eeprom *eeprom,
+                  uint16_t address,
+                  const uint8_t *data,
+                  uint16_t length,
+                  enum twi_error *error) {
+  struct twi_segment segment;
+  uint8_t header, size, i;
+  uint16_t page_left;
+
+  segment.direction = TWI_DIRECTION_WRITE;
+  segment.data = eeprom_page_buffer;
+  *error = TWI_ERROR_NONE;
+
+  while (length > 0) {
+    page_left = eeprom->page_size - address % eeprom->page_size;
+    size = EEPROM_MAX_PAGE_SIZE;
+    if (page_left < size) size = page_left;
+    if (length < size) size = length;
+
+    header = eeprom_put_address(eeprom, address, eeprom_page_buffer);
+    for (i = 0; i < size; i++) {
+      eeprom_page_buffer[header + i] = data[i];
+    }
+
+    segment.address = eeprom_device_address(eeprom, address);
+    segment.length = header + size;
+    if (!eeprom_transfer(&segment, 1, error)) return false;
+
+    address += size;
+    data += size;
+    length -= size;
+  }
+
+  return true;
+}
+
+bool eeprom_read(const struct eeprom *eeprom,
+                 uint16_t address,
+                 uint8_t *data,
+                 uint16_t length,
+                 enum twi_error *error) {
+  uint8_t memory_address[EEPROM_MAX_ADDRESS_BYTES];
+  struct twi_segment segments[2];
+
+  if (length == 0) return false;
+
+  segments[0].address = eeprom_device_address(eeprom, address);
+  segments[0].direction = TWI_DIRECTION_WRITE;
+  segments[0].data = memory_address;
+  segments[0].length = eeprom_put_address(eeprom, address, memory_address);
+
+  segments[1].address = segments[0].address;
+  segments[1].direction = TWI_DIRECTION_READ;
+  segments[1].data = data;
+  segments[1].length = length;
+
+  return eeprom_transfer(segments, 2, error);
+}
+
+bool eeprom_wait(const struct eeprom *eeprom, enum twi_error *error) {
+  struct twi_segment segment = {
+    eeprom->address, TWI_DIRECTION_WRITE, NULL, 0
+  };
+
+  return eeprom_transfer(&segment, 1, error);
+}
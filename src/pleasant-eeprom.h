@@ -0,0 +1,100 @@
+/*
+ * Pleasant EEPROM drives external 24Cxx EEPROMs, such as the 24C256, on top
+ * of Pleasant TWI.
+ *
+ * Writes are split at page boundaries, so every page is written in a single
+ * transaction. After a page has been written, the device is busy with its
+ * internal write cycle for a few milliseconds, during which it does not
+ * acknowledge its address. Instead of waiting a fixed time, every access
+ * retries until the device acknowledges it again. This happens before the
+ * access rather than after it, so eeprom_write returns as soon as the last
+ * page has been sent, and the application can do other work during its write
+ * cycle.
+ *
+ * Reads are done sequentially, in a single transaction of any length. Reading
+ * past the end of the memory wraps around to its start.
+ *
+ * Pleasant TWI has to be initialized using twi_init before any of these
+ * functions are used.
+ */
+
+#ifndef PLEASANT_EEPROM_H
+#define PLEASANT_EEPROM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pleasant-twi.h"
+
+/* Settings -------------------------------------------------------------------
+ * EEPROM_MAX_PAGE_SIZE is the size of the largest page of any device that is
+ * used, which is 128 bytes for the 24C512. A buffer of that size is used for
+ * writes, so it can be lowered to save memory when only smaller devices are
+ * used. EEPROM_POLL_TIMEOUT_MS is how long an access is retried while the
+ * device is busy, which has to be longer than its write cycle, at most 10 ms
+ * for the devices listed below. Attempts are EEPROM_POLL_INTERVAL_US apart,
+ * so the time does not depend on the SCL frequency.
+ */
+
+#ifndef EEPROM_MAX_PAGE_SIZE
+#define EEPROM_MAX_PAGE_SIZE 128
+#endif
+
+#define EEPROM_POLL_TIMEOUT_MS  20
+#define EEPROM_POLL_INTERVAL_US 100
+
+/* Devices --------------------------------------------------------------------
+ * A device is described by its 7-bit TWI address, which is 0x50 plus the
+ * value of its address pins, its page size, and the number of bytes used to
+ * send a memory address:
+ *
+ *   24C01, 24C02:           8 byte pages,   1 address byte
+ *   24C04, 24C08, 24C16:    16 byte pages,  1 address byte
+ *   24C32, 24C64:           32 byte pages,  2 address bytes
+ *   24C128, 24C256:         64 byte pages,  2 address bytes
+ *   24C512:                 128 byte pages, 2 address bytes
+ *
+ * Devices with 1 address byte and more than 256 bytes of memory take the
+ * upper bits of the memory address as part of their TWI address, which is
+ * done automatically.
+ */
+
+struct eeprom {
+  uint8_t address;
+  uint8_t page_size;
+  uint8_t address_bytes;
+};
+
+/* API functions ----------------------------------------------------------- */
+
+/*
+ * Write length bytes of data to the device, starting at memory address
+ * address. True is returned if all data was written. Otherwise, an error is
+ * indicated through the error pointer, and part of the data may have been
+ * written. If the device stays busy for too long, the error is
+ * TWI_ERROR_MASTER_START_REJECTED.
+ */
+bool eeprom_write(const struct eeprom *eeprom,
+                  uint16_t address,
+                  const uint8_t *data,
+                  uint16_t length,
+                  enum twi_error *error);
+
+/*
+ * Read length bytes from the device into data, starting at memory address
+ * address. True is returned if all data was read. Otherwise, an error is
+ * indicated through the error pointer. If the length is 0, false will be
+ * returned and no TWI operations will be performed.
+ */
+bool eeprom_read(const struct eeprom *eeprom,
+                 uint16_t address,
+                 uint8_t *data,
+                 uint16_t length,
+                 enum twi_error *error);
+
+/*
+ * Wait until the device has finished its last write cycle, which should be
+ * done before it is powered down. True is returned if it is ready.
+ */
+bool eeprom_wait(const struct eeprom *eeprom, enum twi_error *error);
+
+#endif /* PLEASANT_EEPROM_H */
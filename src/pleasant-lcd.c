@@ -10,6 +10,11 @@ uint16_t lcd_height = LCD_HEIGHT;
 enum lcd_orientation lcd_current_orientation = LCD_ORIENTATION_0;
 enum spi_clock_speed lcd_spi_clock_speed;
 
+static struct spi_device lcd_spi_device;
+#if LCD_TOUCH
+static struct spi_device lcd_touch_spi_device;
+#endif
+
 /* Pins -------------------------------------------------------------------- */
 
 #define LCD_PIN_DDR_RST    DDRB
@@ -38,23 +43,38 @@ enum spi_clock_speed lcd_spi_clock_speed;
 
 static void lcd_disable_rst() { LCD_PIN_PORT_RST |= (1 << LCD_PIN_RST); }
 static void lcd_enable_rst() { LCD_PIN_PORT_RST &= ~(1 << LCD_PIN_RST); }
-static void lcd_disable_cs() { LCD_PIN_PORT_CS |= (1 << LCD_PIN_CS); }
-static void lcd_enable_cs() { LCD_PIN_PORT_CS &= ~(1 << LCD_PIN_CS); }
-static void lcd_disable_adscs() { LCD_PIN_PORT_ADSCS |= (1 << LCD_PIN_ADSCS); }
-static void lcd_enable_adscs() { LCD_PIN_PORT_ADSCS &= ~(1 << LCD_PIN_ADSCS); }
-
-/* SPI --------------------------------------------------------------------- */
 
-static void lcd_speed_down_spi() {
-  spi_configure(SPI_CLOCK_SPEED_DIV_8, SPI_BIT_ORDER_MSB_FIRST);
-}
+/* SPI ------------------------------------------------------------------------
+ * The display and the touch controller are separate devices on the SPI bus,
+ * each with its own clock speed and chip select pin.
+ */
 
 static void lcd_configure_spi() {
-  spi_configure(lcd_spi_clock_speed, SPI_BIT_ORDER_MSB_FIRST);
+  spi_device_init(&lcd_spi_device,
+                  lcd_spi_clock_speed,
+                  SPI_BIT_ORDER_MSB_FIRST,
+                  SPI_MODE_0,
+                  &LCD_PIN_DDR_CS,
+                  &LCD_PIN_PORT_CS,
+                  LCD_PIN_CS);
+#if LCD_TOUCH
+  spi_device_init(&lcd_touch_spi_device,
+                  LCD_TOUCH_SPI_CLOCK_SPEED,
+                  SPI_BIT_ORDER_MSB_FIRST,
+                  SPI_MODE_0,
+                  &LCD_PIN_DDR_ADSCS,
+                  &LCD_PIN_PORT_ADSCS,
+                  LCD_PIN_ADSCS);
+#else
+  /* The touch controller still shares the bus, so it has to stay
+     deselected. */
+  LCD_PIN_PORT_ADSCS |= (1 << LCD_PIN_ADSCS);
+  LCD_PIN_DDR_ADSCS |= (1 << LCD_PIN_ADSCS);
+#endif
 }
 
-static void lcd_start_transmission() { lcd_enable_cs(); }
-static void lcd_stop_transmission() { lcd_disable_cs(); }
+static void lcd_start_transmission() { spi_select(&lcd_spi_device); }
+static void lcd_stop_transmission() { spi_deselect(&lcd_spi_device); }
 
 static void lcd_send_9th_bit(bool enabled) {
   if (enabled) LCD_PIN_PORT_MOSI |= (1 << LCD_PIN_MOSI);
@@ -84,9 +104,11 @@ static void lcd_send_data16(uint16_t data) {
   lcd_send_raw(data, false);
 }
 
+#if LCD_TOUCH
 static uint8_t lcd_read_spi() {
   return spi_transfer(0);
 }
+#endif
 
 /* Reset ------------------------------------------------------------------- */
 
@@ -147,7 +169,7 @@ static void lcd_reset() {
   uint8_t instruction;
   const uint8_t *ptr;
 
-  lcd_disable_cs();
+  lcd_stop_transmission();
   lcd_enable_rst();
   _delay_ms(50);
   lcd_disable_rst();
@@ -189,14 +211,8 @@ void lcd_init(enum spi_clock_speed clock_speed) {
   /* Initialize LCD */
   LCD_PIN_DDR_RST |= (1 << LCD_PIN_RST);
   LCD_PIN_DDR_LED |= (1 << LCD_PIN_LED);
-  LCD_PIN_DDR_CS |= (1 << LCD_PIN_CS);
-  lcd_disable_cs();
 
-  /* Initialize ADS */
-  LCD_PIN_DDR_ADSCS |= (1 << LCD_PIN_ADSCS);
-  lcd_disable_adscs();
-
-  /* Initialize SPI */
+  /* Initialize SPI, along with the chip select pins of the LCD and ADS */
   lcd_spi_clock_speed = clock_speed;
   lcd_configure_spi();
 
@@ -304,6 +320,8 @@ void lcd_fill_rect(uint16_t x,
 
 /* Touch ------------------------------------------------------------------- */
 
+#if LCD_TOUCH
+
 struct calibration_point {
   uint32_t x;
   uint32_t y;
@@ -483,8 +501,7 @@ bool lcd_touch_read_raw(uint16_t *touch_pressure,
   uint16_t x = 0, y = 0;
   bool x_consistent = false, y_consistent = false;
 
-  lcd_speed_down_spi();
-  lcd_enable_adscs();
+  spi_select(&lcd_touch_spi_device);
 
   pressure = lcd_touch_get_pressure();
 
@@ -498,8 +515,7 @@ bool lcd_touch_read_raw(uint16_t *touch_pressure,
     }
   }
 
-  lcd_disable_adscs();
-  lcd_configure_spi();
+  spi_deselect(&lcd_touch_spi_device);
 
   if (x_consistent && y_consistent) {
     if (touch_pressure) *touch_pressure = pressure;
@@ -602,3 +618,5 @@ bool lcd_touch_read(uint16_t *touch_pressure,
 
   return false;
 }
+
+#endif
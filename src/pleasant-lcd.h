@@ -160,6 +160,17 @@ typedef uint16_t lcd_color;
 #define LCD_TOUCH_REQUIRED_PRESSURE 5
 
 #define LCD_DEFAULT_SPI_CLOCK_SPEED SPI_CLOCK_SPEED_DIV_2
+#define LCD_TOUCH_SPI_CLOCK_SPEED   SPI_CLOCK_SPEED_DIV_8
+
+/* Touch screen ---------------------------------------------------------------
+ * Firmware that does not use the touch screen can define LCD_TOUCH as 0 when
+ * building Pleasant LCD. The touch functions and the calibration data are
+ * then left out, and the touch controller is only kept deselected.
+ */
+
+#ifndef LCD_TOUCH
+#define LCD_TOUCH 1
+#endif
 
 /* State ------------------------------------------------------------------- */
 
@@ -175,8 +186,9 @@ extern enum lcd_orientation lcd_current_orientation;
  * initializes SPI, timer 1 and various ports.
  *
  * An SPI clock speed can be chosen if so desired, but it is suggested you use
- * LCD_DEFAULT_SPI_CLOCK_SPEED. Note that lcd_touch_read will temporarily
- * change the clock speed to SPI_CLOCK_SPEED_DIV_8 every time it is called.
+ * LCD_DEFAULT_SPI_CLOCK_SPEED. The touch controller always uses
+ * LCD_TOUCH_SPI_CLOCK_SPEED. Both are set up as SPI devices, so switching
+ * between them only reconfigures the SPI module when necessary.
  */
 void lcd_init(enum spi_clock_speed clock_speed);
 
@@ -238,6 +250,8 @@ void lcd_fill_rect(uint16_t x,
 
 /* Touch ------------------------------------------------------------------- */
 
+#if LCD_TOUCH
+
 /*
  * Calibrate the touch screen in order to accurately read touch position.
  */
@@ -264,4 +278,6 @@ bool lcd_touch_read(uint16_t *touch_pressure,
                     uint16_t *touch_x,
                     uint16_t *touch_y);
 
+#endif
+
 #endif /* SIMPLE_LCD_H */
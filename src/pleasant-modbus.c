@@ -0,0 +1,478 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include "pleasant-timer.h"
+#include "pleasant-usart.h"
+#include "pleasant-modbus.h"
+
+#if !USART_RECEIVER
+#error "Pleasant Modbus needs USART_RECEIVER"
+#endif
+
+#define MODBUS_CRC_INITIAL 0xFFFF
+
+#define MODBUS_FUNCTION_READ_COILS               0x01
+#define MODBUS_FUNCTION_READ_DISCRETE_INPUTS     0x02
+#define MODBUS_FUNCTION_READ_HOLDING_REGISTERS   0x03
+#define MODBUS_FUNCTION_READ_INPUT_REGISTERS     0x04
+#define MODBUS_FUNCTION_WRITE_SINGLE_COIL        0x05
+#define MODBUS_FUNCTION_WRITE_SINGLE_REGISTER    0x06
+#define MODBUS_FUNCTION_WRITE_MULTIPLE_COILS     0x0F
+#define MODBUS_FUNCTION_WRITE_MULTIPLE_REGISTERS 0x10
+
+#define MODBUS_EXCEPTION_FLAG 0x80
+
+#define MODBUS_COIL_ON  0xFF00
+#define MODBUS_COIL_OFF 0x0000
+
+/* Address, function code and CRC */
+#define MODBUS_MIN_FRAME_LENGTH 4
+
+#define MODBUS_TIMER_CLOCK_MASK ((1 << CS02) | (1 << CS01) | (1 << CS00))
+
+static uint8_t modbus_address;
+static struct modbus_table *modbus_table;
+
+void (*modbus_write_callback)(enum modbus_table_type type,
+                              uint16_t address,
+                              uint16_t count);
+
+/* Receiving ------------------------------------------------------------------
+ * Every received byte restarts timer 0. Compare B fires after 1.5 character
+ * times of silence, which ends the frame, and compare A fires after 3.5
+ * character times, at which point the frame is handed to modbus_poll if it is
+ * intact and addressed to us.
+ *
+ * A byte arriving between the two means the frame was interrupted, so it is
+ * discarded along with everything up to the next 3.5 character silence. While
+ * a frame is waiting to be processed, incoming bytes are ignored.
+ */
+
+enum modbus_state {
+  MODBUS_STATE_IDLE,
+  MODBUS_STATE_RECEIVING,
+  MODBUS_STATE_FRAME_ENDED,
+  MODBUS_STATE_DISCARDING,
+  MODBUS_STATE_FRAME_READY
+};
+
+static volatile enum modbus_state modbus_state;
+
+static uint8_t modbus_buffer[MODBUS_BUFFER_SIZE];
+static uint8_t modbus_length;
+static uint16_t modbus_crc;
+
+static enum timer_clock_source modbus_timer_clock_source;
+
+static void modbus_restart_timer() {
+  TCNT0 = 0;
+  TIFR0 = (1 << OCF0A) | (1 << OCF0B);
+  TCCR0B = (TCCR0B & ~MODBUS_TIMER_CLOCK_MASK) | modbus_timer_clock_source;
+}
+
+static void modbus_stop_timer() {
+  TCCR0B &= ~MODBUS_TIMER_CLOCK_MASK;
+}
+
+static void modbus_receive_byte(uint8_t byte, enum usart_error error) {
+  switch (modbus_state) {
+  case MODBUS_STATE_FRAME_READY:
+    return;
+  case MODBUS_STATE_IDLE:
+    modbus_length = 0;
+    modbus_crc = MODBUS_CRC_INITIAL;
+    modbus_state = MODBUS_STATE_RECEIVING;
+    /* Fall through */
+  case MODBUS_STATE_RECEIVING:
+    if (error != USART_ERROR_NO_ERROR || modbus_length == MODBUS_BUFFER_SIZE) {
+      modbus_state = MODBUS_STATE_DISCARDING;
+    } else {
+      *(modbus_buffer + modbus_length++) = byte;
+      modbus_crc = _crc16_update(modbus_crc, byte);
+    }
+    break;
+  case MODBUS_STATE_FRAME_ENDED:
+    modbus_state = MODBUS_STATE_DISCARDING;
+    break;
+  case MODBUS_STATE_DISCARDING:
+    break;
+  }
+
+  modbus_restart_timer();
+}
+
+ISR(TIMER0_COMPB_vect) {
+  if (modbus_state == MODBUS_STATE_RECEIVING) {
+    modbus_state = MODBUS_STATE_FRAME_ENDED;
+  }
+}
+
+ISR(TIMER0_COMPA_vect) {
+  modbus_stop_timer();
+
+  if (modbus_state == MODBUS_STATE_FRAME_ENDED
+      && modbus_length >= MODBUS_MIN_FRAME_LENGTH
+      && modbus_crc == 0
+      && (*modbus_buffer == modbus_address
+          || *modbus_buffer == MODBUS_BROADCAST_ADDRESS)) {
+    modbus_state = MODBUS_STATE_FRAME_READY;
+  } else {
+    modbus_state = MODBUS_STATE_IDLE;
+  }
+}
+
+/* Timing ---------------------------------------------------------------------
+ * Character times assume 11 bits per character, and are computed in CPU cycles
+ * from the usart_baud value, so no division is needed. Above 19200 baud the
+ * standard specifies fixed times of 750us and 1750us instead. Timer 0 runs
+ * with the smallest prescaler for which 3.5 character times fit in 8 bits.
+ */
+
+#define MODBUS_CYCLES_PER_US (F_CPU / 1000000)
+
+/* The bit time at 19200 baud, allowing for the baud rate error. */
+#define MODBUS_FIXED_TIMING_BIT_CYCLES                                        \
+  (F_CPU / (19200 + 19200 * USART_BAUD_TOLERANCE / 1000))
+
+/* Prescalers of timer 0 as powers of 2, starting at TIMER_CLOCK_SOURCE_DIV_8 */
+static const uint8_t modbus_prescaler_shifts[] = { 3, 6, 8, 10 };
+
+static uint8_t modbus_ticks(uint32_t cycles, uint8_t shift) {
+  uint32_t ticks = (cycles + (1 << shift) - 1) >> shift;
+  return ticks > 0xFF ? 0xFF : ticks;
+}
+
+static void modbus_init_timer(usart_baud baud) {
+  uint32_t bit_cycles = (uint32_t)((baud & USART_BAUD_UBRR_MASK) + 1)
+    * (baud & USART_BAUD_DOUBLE_SPEED_FLAG
+       ? USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED
+       : USART_ASYNCHRONOUS_MODE_NORMAL_SPEED);
+  uint32_t t15 = 750 * MODBUS_CYCLES_PER_US;
+  uint32_t t35 = 1750 * MODBUS_CYCLES_PER_US;
+  uint8_t i;
+
+  if (bit_cycles >= MODBUS_FIXED_TIMING_BIT_CYCLES) {
+    t15 = (bit_cycles * 33) >> 1;
+    t35 = (bit_cycles * 77) >> 1;
+  }
+
+  for (i = 0; i < sizeof(modbus_prescaler_shifts) - 1; i++) {
+    if (modbus_ticks(t35, modbus_prescaler_shifts[i]) < 0xFF) break;
+  }
+  modbus_timer_clock_source = TIMER_CLOCK_SOURCE_DIV_8 + i;
+
+  timer0_init(TIMER_WAVE_TYPE_NORMAL,
+              TIMER_WRAP_TYPE_COMPARE_A,
+              TIMER_CLOCK_SOURCE_OFF,
+              TIMER_INTERRUPT_COMPARE_A | TIMER_INTERRUPT_COMPARE_B,
+              TIMER_COMPARE_OUTPUT_MODE_OFF,
+              TIMER_COMPARE_OUTPUT_MODE_OFF);
+  TIMER0_COMPARE_A = modbus_ticks(t35, modbus_prescaler_shifts[i]);
+  TIMER0_COMPARE_B = modbus_ticks(t15, modbus_prescaler_shifts[i]);
+}
+
+/* Processing -------------------------------------------------------------- */
+
+static uint16_t modbus_get_word(const uint8_t *bytes) {
+  return ((uint16_t)*bytes << 8) | *(bytes + 1);
+}
+
+static void modbus_put_word(uint8_t *bytes, uint16_t word) {
+  *bytes = word >> 8;
+  *(bytes + 1) = word & 0xFF;
+}
+
+static bool modbus_get_bit(const uint8_t *bits, uint16_t index) {
+  return *(bits + (index >> 3)) & (1 << (index & 7));
+}
+
+static void modbus_put_bit(uint8_t *bits, uint16_t index, bool value) {
+  if (value) *(bits + (index >> 3)) |= (1 << (index & 7));
+  else *(bits + (index >> 3)) &= ~(1 << (index & 7));
+}
+
+static void modbus_notify(enum modbus_table_type type,
+                          uint16_t address,
+                          uint16_t count) {
+  if (modbus_write_callback) modbus_write_callback(type, address, count);
+}
+
+/*
+ * Check a range of items against a table. Returns 0 if it is valid, or the
+ * exception to respond with.
+ */
+static uint8_t modbus_check_range(uint16_t address,
+                                  uint16_t count,
+                                  uint16_t max_count,
+                                  uint16_t table_count) {
+  if (count == 0 || count > max_count) {
+    return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+  }
+  if (address >= table_count || count > table_count - address) {
+    return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+  }
+  return 0;
+}
+
+/*
+ * The response is built in place over the request, with the address and
+ * function code left as they are. Each handler returns the length of the
+ * response without its CRC, or sets *exception.
+ */
+
+static uint8_t modbus_read_bits(uint8_t *frame,
+                                const uint8_t *bits,
+                                uint16_t bit_count,
+                                uint8_t *exception) {
+  uint16_t address = modbus_get_word(frame + 2);
+  uint16_t count = modbus_get_word(frame + 4);
+  uint8_t byte_count = (count + 7) / 8;
+  uint16_t i;
+
+  *exception = modbus_check_range(address, count,
+                                  (MODBUS_BUFFER_SIZE - 5) * 8, bit_count);
+  if (*exception) return 0;
+
+  *(frame + 2) = byte_count;
+  for (i = 0; i < byte_count; i++) *(frame + 3 + i) = 0;
+  for (i = 0; i < count; i++) {
+    if (modbus_get_bit(bits, address + i)) modbus_put_bit(frame + 3, i, true);
+  }
+  return 3 + byte_count;
+}
+
+static uint8_t modbus_read_registers(uint8_t *frame,
+                                     const uint16_t *registers,
+                                     uint16_t register_count,
+                                     uint8_t *exception) {
+  uint16_t address = modbus_get_word(frame + 2);
+  uint16_t count = modbus_get_word(frame + 4);
+  uint16_t i;
+
+  *exception = modbus_check_range(address, count,
+                                  (MODBUS_BUFFER_SIZE - 5) / 2,
+                                  register_count);
+  if (*exception) return 0;
+
+  *(frame + 2) = count * 2;
+  for (i = 0; i < count; i++) {
+    modbus_put_word(frame + 3 + i * 2, *(registers + address + i));
+  }
+  return 3 + count * 2;
+}
+
+static uint8_t modbus_write_single_coil(uint8_t *frame, uint8_t *exception) {
+  uint16_t address = modbus_get_word(frame + 2);
+  uint16_t value = modbus_get_word(frame + 4);
+
+  if (value != MODBUS_COIL_ON && value != MODBUS_COIL_OFF) {
+    *exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    return 0;
+  }
+  *exception = modbus_check_range(address, 1, 1, modbus_table->coil_count);
+  if (*exception) return 0;
+
+  modbus_put_bit(modbus_table->coils, address, value == MODBUS_COIL_ON);
+  modbus_notify(MODBUS_TABLE_TYPE_COILS, address, 1);
+  return 6;
+}
+
+static uint8_t modbus_write_single_register(uint8_t *frame,
+                                            uint8_t *exception) {
+  uint16_t address = modbus_get_word(frame + 2);
+
+  *exception = modbus_check_range(address, 1, 1,
+                                  modbus_table->holding_register_count);
+  if (*exception) return 0;
+
+  *(modbus_table->holding_registers + address) = modbus_get_word(frame + 4);
+  modbus_notify(MODBUS_TABLE_TYPE_HOLDING_REGISTERS, address, 1);
+  return 6;
+}
+
+static uint8_t modbus_write_multiple_coils(uint8_t *frame,
+                                           uint8_t length,
+                                           uint8_t *exception) {
+  uint16_t address = modbus_get_word(frame + 2);
+  uint16_t count = modbus_get_word(frame + 4);
+  uint8_t byte_count = *(frame + 6);
+  uint16_t i;
+
+  if (byte_count != (count + 7) / 8 || length != 7 + byte_count) {
+    *exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    return 0;
+  }
+  *exception = modbus_check_range(address, count, 0x07B0,
+                                  modbus_table->coil_count);
+  if (*exception) return 0;
+
+  for (i = 0; i < count; i++) {
+    modbus_put_bit(modbus_table->coils, address + i,
+                   modbus_get_bit(frame + 7, i));
+  }
+  modbus_notify(MODBUS_TABLE_TYPE_COILS, address, count);
+  return 6;
+}
+
+static uint8_t modbus_write_multiple_registers(uint8_t *frame,
+                                               uint8_t length,
+                                               uint8_t *exception) {
+  uint16_t address = modbus_get_word(frame + 2);
+  uint16_t count = modbus_get_word(frame + 4);
+  uint8_t byte_count = *(frame + 6);
+  uint16_t i;
+
+  if (byte_count != count * 2 || length != 7 + byte_count) {
+    *exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    return 0;
+  }
+  *exception = modbus_check_range(address, count, 0x007B,
+                                  modbus_table->holding_register_count);
+  if (*exception) return 0;
+
+  for (i = 0; i < count; i++) {
+    *(modbus_table->holding_registers + address + i) =
+      modbus_get_word(frame + 7 + i * 2);
+  }
+  modbus_notify(MODBUS_TABLE_TYPE_HOLDING_REGISTERS, address, count);
+  return 6;
+}
+
+/*
+ * Process the request in the frame buffer, which is length bytes long without
+ * its CRC. Returns the length of the response without its CRC.
+ */
+static uint8_t modbus_process(uint8_t *frame, uint8_t length) {
+  uint8_t function = *(frame + 1);
+  uint8_t exception = 0;
+  uint8_t response_length = 0;
+
+  if (function == 0
+      || (function > MODBUS_FUNCTION_WRITE_SINGLE_REGISTER
+          && function != MODBUS_FUNCTION_WRITE_MULTIPLE_COILS
+          && function != MODBUS_FUNCTION_WRITE_MULTIPLE_REGISTERS)) {
+    exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+  } else if (function == MODBUS_FUNCTION_WRITE_MULTIPLE_COILS
+             || function == MODBUS_FUNCTION_WRITE_MULTIPLE_REGISTERS) {
+    if (length < 7) exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+  } else if (length != 6) {
+    exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+  }
+
+  if (!exception) {
+    switch (function) {
+    case MODBUS_FUNCTION_READ_COILS:
+      response_length = modbus_read_bits(frame,
+                                         modbus_table->coils,
+                                         modbus_table->coil_count,
+                                         &exception);
+      break;
+    case MODBUS_FUNCTION_READ_DISCRETE_INPUTS:
+      response_length = modbus_read_bits(frame,
+                                         modbus_table->discrete_inputs,
+                                         modbus_table->discrete_input_count,
+                                         &exception);
+      break;
+    case MODBUS_FUNCTION_READ_HOLDING_REGISTERS:
+      response_length =
+        modbus_read_registers(frame,
+                              modbus_table->holding_registers,
+                              modbus_table->holding_register_count,
+                              &exception);
+      break;
+    case MODBUS_FUNCTION_READ_INPUT_REGISTERS:
+      response_length =
+        modbus_read_registers(frame,
+                              modbus_table->input_registers,
+                              modbus_table->input_register_count,
+                              &exception);
+      break;
+    case MODBUS_FUNCTION_WRITE_SINGLE_COIL:
+      response_length = modbus_write_single_coil(frame, &exception);
+      break;
+    case MODBUS_FUNCTION_WRITE_SINGLE_REGISTER:
+      response_length = modbus_write_single_register(frame, &exception);
+      break;
+    case MODBUS_FUNCTION_WRITE_MULTIPLE_COILS:
+      response_length = modbus_write_multiple_coils(frame, length,
+                                                    &exception);
+      break;
+    case MODBUS_FUNCTION_WRITE_MULTIPLE_REGISTERS:
+      response_length = modbus_write_multiple_registers(frame, length,
+                                                        &exception);
+      break;
+    }
+  }
+
+  if (exception) {
+    *(frame + 1) = function | MODBUS_EXCEPTION_FLAG;
+    *(frame + 2) = exception;
+    response_length = 3;
+  }
+  return response_length;
+}
+
+static void modbus_send(uint8_t *frame, uint8_t length) {
+  uint16_t crc = MODBUS_CRC_INITIAL;
+  uint8_t i;
+
+  for (i = 0; i < length; i++) crc = _crc16_update(crc, *(frame + i));
+  /* The Modbus CRC is sent low byte first. */
+  *(frame + length++) = crc & 0xFF;
+  *(frame + length++) = crc >> 8;
+
+#ifdef MODBUS_DE_PIN
+  MODBUS_DE_PORT |= (1 << MODBUS_DE_PIN);
+#endif
+  usart_write_bytes(frame, length);
+#ifdef MODBUS_DE_PIN
+  usart_flush();
+  MODBUS_DE_PORT &= ~(1 << MODBUS_DE_PIN);
+#endif
+}
+
+/* API functions ----------------------------------------------------------- */
+
+void modbus_init(uint8_t address,
+                 usart_baud baud,
+                 struct modbus_table *table) {
+  modbus_address = address;
+  modbus_table = table;
+
+#ifdef MODBUS_DE_PIN
+  MODBUS_DE_DDR |= (1 << MODBUS_DE_PIN);
+  MODBUS_DE_PORT &= ~(1 << MODBUS_DE_PIN);
+#endif
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    modbus_init_timer(baud);
+    modbus_state = MODBUS_STATE_IDLE;
+    usart_receive_callback = modbus_receive_byte;
+  }
+}
+
+bool modbus_poll() {
+  bool broadcast;
+  uint8_t length;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (modbus_state != MODBUS_STATE_FRAME_READY) return false;
+  }
+
+  broadcast = *modbus_buffer == MODBUS_BROADCAST_ADDRESS;
+  length = modbus_process(modbus_buffer, modbus_length - 2);
+
+  /* Anything that arrived in the meantime was missed, so wait for silence
+   * before accepting the next request. */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    modbus_state = MODBUS_STATE_DISCARDING;
+    modbus_restart_timer();
+  }
+
+  if (!broadcast) modbus_send(modbus_buffer, length);
+  return true;
+}
@@ -0,0 +1,120 @@
+/*
+ * Pleasant Modbus implements a Modbus RTU slave on top of Pleasant USART.
+ *
+ * Frames are collected directly from the USART receive interrupt, with the
+ * CRC being checked as bytes arrive. Timer 0 measures the silence after every
+ * byte: a gap of 1.5 character times ends the frame, and once 3.5 character
+ * times have passed the frame is complete. Frames with a gap in the middle,
+ * or a bad CRC, are ignored.
+ *
+ * Requests are answered from a table of coils, discrete inputs, holding
+ * registers and input registers, which the application provides. The
+ * following function codes are supported:
+ *
+ * - 0x01 Read Coils
+ * - 0x02 Read Discrete Inputs
+ * - 0x03 Read Holding Registers
+ * - 0x04 Read Input Registers
+ * - 0x05 Write Single Coil
+ * - 0x06 Write Single Register
+ * - 0x0F Write Multiple Coils
+ * - 0x10 Write Multiple Registers
+ *
+ * Pleasant Modbus takes over usart_receive_callback and timer 0. At 16 MHz,
+ * baud rates from 2400 upwards are supported.
+ */
+
+#ifndef PLEASANT_MODBUS_H
+#define PLEASANT_MODBUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pleasant-usart.h"
+
+/* Settings -------------------------------------------------------------------
+ * The frame buffer holds a complete request, and the response built from it.
+ * Its size can be at most 255, which limits the number of registers that can
+ * be read or written at once.
+ *
+ * If MODBUS_DE_PIN is defined, that pin is driven high while a response is
+ * being sent, to enable an RS-485 driver.
+ */
+
+#define MODBUS_BUFFER_SIZE 128
+
+#ifdef MODBUS_DE_PIN
+
+#ifndef MODBUS_DE_DDR
+#define MODBUS_DE_DDR DDRD
+#endif
+
+#ifndef MODBUS_DE_PORT
+#define MODBUS_DE_PORT PORTD
+#endif
+
+#endif
+
+#define MODBUS_BROADCAST_ADDRESS 0
+
+/* Register table -------------------------------------------------------------
+ * Coils and discrete inputs are stored as bit arrays, with bit 0 of the first
+ * byte being item 0. Tables the application does not have can be left NULL,
+ * with a count of 0.
+ */
+
+enum modbus_table_type {
+  MODBUS_TABLE_TYPE_COILS,
+  MODBUS_TABLE_TYPE_DISCRETE_INPUTS,
+  MODBUS_TABLE_TYPE_HOLDING_REGISTERS,
+  MODBUS_TABLE_TYPE_INPUT_REGISTERS
+};
+
+struct modbus_table {
+  uint8_t *coils;
+  uint16_t coil_count;
+  uint8_t *discrete_inputs;
+  uint16_t discrete_input_count;
+  uint16_t *holding_registers;
+  uint16_t holding_register_count;
+  uint16_t *input_registers;
+  uint16_t input_register_count;
+};
+
+/* Exceptions -------------------------------------------------------------- */
+
+enum modbus_exception {
+  MODBUS_EXCEPTION_ILLEGAL_FUNCTION     = 0x01,
+  MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS = 0x02,
+  MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE   = 0x03
+};
+
+/* Callbacks --------------------------------------------------------------- */
+
+/*
+ * Function called after a master has written to coils or holding registers,
+ * with the type of table, the first address and the number of items written.
+ */
+extern void (*modbus_write_callback)(enum modbus_table_type type,
+                                     uint16_t address,
+                                     uint16_t count);
+
+/* API functions ----------------------------------------------------------- */
+
+/*
+ * Start acting as the slave with the specified address. The USART has to be
+ * initialized separately, using usart_init, with the same usart_baud value,
+ * which is used to compute the frame timing. The table is used directly, and
+ * must stay valid.
+ */
+void modbus_init(uint8_t address,
+                 usart_baud baud,
+                 struct modbus_table *table);
+
+/*
+ * Process a received request, if there is one, and send the response. This
+ * should be called regularly from the main loop. Returns true if a request was
+ * processed.
+ */
+bool modbus_poll();
+
+#endif /* PLEASANT_MODBUS_H */
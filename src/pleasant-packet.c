@@ -0,0 +1,256 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include "pleasant-usart.h"
+#include "pleasant-packet.h"
+
+#define PACKET_CRC_INITIAL 0xFFFF
+
+#define PACKET_COBS_DELIMITER 0x00
+#define PACKET_COBS_MAX_CODE  0xFF
+
+#define PACKET_SLIP_END     0xC0
+#define PACKET_SLIP_ESC     0xDB
+#define PACKET_SLIP_ESC_END 0xDC
+#define PACKET_SLIP_ESC_ESC 0xDD
+
+static enum packet_encoding packet_encoding;
+
+/* Receiving ------------------------------------------------------------------
+ * Bytes are decoded into the frame buffer as they arrive, and the CRC is
+ * updated with every decoded byte. Because the CRC is sent high byte first,
+ * running it over both the data and the CRC results in 0 for an intact frame.
+ *
+ * After an error, the rest of the frame is discarded, up to the next frame
+ * delimiter.
+ */
+
+#if USART_RECEIVER
+
+static volatile uint8_t packet_buffer[PACKET_BUFFER_SIZE];
+static volatile uint8_t packet_length;
+static volatile bool packet_ready;
+static volatile uint16_t packet_dropped_count;
+
+static uint8_t packet_decoded_length;
+static uint16_t packet_crc;
+static bool packet_discarding;
+
+static uint8_t packet_cobs_code;
+static uint8_t packet_cobs_remaining;
+static bool packet_slip_escaped;
+
+static void packet_start_frame() {
+  packet_decoded_length = 0;
+  packet_crc = PACKET_CRC_INITIAL;
+  packet_discarding = false;
+
+  /* No zero is added before the first block. */
+  packet_cobs_code = PACKET_COBS_MAX_CODE;
+  packet_cobs_remaining = 0;
+  packet_slip_escaped = false;
+}
+
+static void packet_drop_frame() {
+  if (!packet_discarding) packet_dropped_count++;
+  packet_discarding = true;
+}
+
+static void packet_append(uint8_t byte) {
+  if (packet_ready || packet_decoded_length == PACKET_BUFFER_SIZE) {
+    packet_drop_frame();
+    return;
+  }
+
+  packet_buffer[packet_decoded_length++] = byte;
+  packet_crc = _crc_xmodem_update(packet_crc, byte);
+}
+
+static void packet_end_frame(bool complete) {
+  if (!packet_discarding && packet_decoded_length > 0) {
+    if (complete && packet_decoded_length >= 2 && packet_crc == 0) {
+      packet_length = packet_decoded_length - 2;
+      packet_ready = true;
+    } else {
+      packet_dropped_count++;
+    }
+  }
+
+  packet_start_frame();
+}
+
+static void packet_cobs_receive(uint8_t byte) {
+  if (byte == PACKET_COBS_DELIMITER) {
+    packet_end_frame(packet_cobs_remaining == 0);
+    return;
+  }
+  if (packet_discarding) return;
+
+  if (packet_cobs_remaining == 0) {
+    /* Every block but the last, unless it has the maximum length, is followed
+       by a zero. We only know it was not the last one now. */
+    if (packet_cobs_code != PACKET_COBS_MAX_CODE) packet_append(0);
+
+    packet_cobs_code = byte;
+    packet_cobs_remaining = byte - 1;
+  } else {
+    packet_append(byte);
+    packet_cobs_remaining--;
+  }
+}
+
+static void packet_slip_receive(uint8_t byte) {
+  if (byte == PACKET_SLIP_END) {
+    packet_end_frame(!packet_slip_escaped);
+    return;
+  }
+  if (packet_discarding) return;
+
+  if (packet_slip_escaped) {
+    packet_slip_escaped = false;
+
+    if (byte == PACKET_SLIP_ESC_END)      packet_append(PACKET_SLIP_END);
+    else if (byte == PACKET_SLIP_ESC_ESC) packet_append(PACKET_SLIP_ESC);
+    else                                  packet_drop_frame();
+  } else if (byte == PACKET_SLIP_ESC) {
+    packet_slip_escaped = true;
+  } else {
+    packet_append(byte);
+  }
+}
+
+static void packet_receive_byte(uint8_t byte, enum usart_error error) {
+  if (error != USART_ERROR_NO_ERROR) packet_drop_frame();
+
+  if (packet_encoding == PACKET_ENCODING_COBS) {
+    packet_cobs_receive(byte);
+  } else {
+    packet_slip_receive(byte);
+  }
+}
+
+#endif
+
+/* Sending ----------------------------------------------------------------- */
+
+/* The bytes sent are the data, followed by the two CRC bytes. */
+static uint8_t packet_send_byte(const uint8_t *data,
+                                size_t length,
+                                uint16_t crc,
+                                size_t index) {
+  if (index < length) return *(data + index);
+  return index == length ? (crc >> 8) : (crc & 0xFF);
+}
+
+static void packet_cobs_send(const uint8_t *data, size_t length, uint16_t crc) {
+  size_t total = length + 2;
+  size_t index = 0;
+  size_t run, i;
+
+  while (1) {
+    run = 0;
+    while (index + run < total
+           && run < PACKET_COBS_MAX_CODE - 1
+           && packet_send_byte(data, length, crc, index + run) != 0) {
+      run++;
+    }
+
+    usart_write(run + 1);
+    for (i = 0; i < run; i++) {
+      usart_write(packet_send_byte(data, length, crc, index + i));
+    }
+    index += run;
+
+    if (index == total) break;
+    /* Skip the zero that ended this block. */
+    if (run < PACKET_COBS_MAX_CODE - 1) index++;
+  }
+
+  usart_write(PACKET_COBS_DELIMITER);
+}
+
+static void packet_slip_send(const uint8_t *data, size_t length, uint16_t crc) {
+  size_t i;
+  uint8_t byte;
+
+  /* A leading END flushes any noise received before the frame. */
+  usart_write(PACKET_SLIP_END);
+
+  for (i = 0; i < length + 2; i++) {
+    byte = packet_send_byte(data, length, crc, i);
+
+    if (byte == PACKET_SLIP_END) {
+      usart_write(PACKET_SLIP_ESC);
+      usart_write(PACKET_SLIP_ESC_END);
+    } else if (byte == PACKET_SLIP_ESC) {
+      usart_write(PACKET_SLIP_ESC);
+      usart_write(PACKET_SLIP_ESC_ESC);
+    } else {
+      usart_write(byte);
+    }
+  }
+
+  usart_write(PACKET_SLIP_END);
+}
+
+/* API functions ----------------------------------------------------------- */
+
+void packet_init(enum packet_encoding encoding) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    packet_encoding = encoding;
+#if USART_RECEIVER
+    packet_ready = false;
+    packet_dropped_count = 0;
+    packet_start_frame();
+
+    usart_receive_callback = packet_receive_byte;
+#endif
+  }
+}
+
+#if USART_RECEIVER
+
+uint8_t *packet_receive(uint8_t *length) {
+  if (!packet_ready) return NULL;
+
+  *length = packet_length;
+  return (uint8_t *)packet_buffer;
+}
+
+void packet_release() {
+  packet_ready = false;
+}
+
+#endif
+
+void packet_send(const uint8_t *data, size_t length) {
+  uint16_t crc = PACKET_CRC_INITIAL;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    crc = _crc_xmodem_update(crc, *(data + i));
+  }
+
+  if (packet_encoding == PACKET_ENCODING_COBS) {
+    packet_cobs_send(data, length, crc);
+  } else {
+    packet_slip_send(data, length, crc);
+  }
+}
+
+#if USART_RECEIVER
+
+uint16_t packet_dropped() {
+  uint16_t dropped;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    dropped = packet_dropped_count;
+    packet_dropped_count = 0;
+  }
+
+  return dropped;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Pleasant Packet implements a framed packet layer on top of Pleasant USART.
+ * Every packet is followed by a CRC16 (CCITT, initial value 0xFFFF, sent high
+ * byte first) and then framed using either COBS or SLIP.
+ *
+ * Received frames are decoded in place, directly from the USART receive
+ * interrupt, and the CRC is checked as bytes arrive. A complete packet is
+ * handed to the application as a pointer into the frame buffer. Until the
+ * packet is released, further frames are dropped, so it should be released as
+ * soon as possible.
+ *
+ * Pleasant Packet takes over usart_receive_callback, so the other USART read
+ * functions can not be used at the same time. When Pleasant USART is built
+ * with USART_RECEIVER defined as 0, only sending is available.
+ */
+
+#ifndef PLEASANT_PACKET_H
+#define PLEASANT_PACKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pleasant-usart.h"
+
+/* Settings -------------------------------------------------------------------
+ * The frame buffer holds a single decoded packet, including its CRC. Its size
+ * can be at most 255.
+ */
+
+#define PACKET_BUFFER_SIZE 130
+#define PACKET_MAX_SIZE    (PACKET_BUFFER_SIZE - 2)
+
+/* Encoding ---------------------------------------------------------------- */
+
+enum packet_encoding {
+  PACKET_ENCODING_COBS,
+  PACKET_ENCODING_SLIP
+};
+
+/* API functions ----------------------------------------------------------- */
+
+/*
+ * Start decoding received frames using the specified encoding, which is also
+ * used for sending. The USART has to be initialized separately, using
+ * usart_init.
+ */
+void packet_init(enum packet_encoding encoding);
+
+#if USART_RECEIVER
+
+/*
+ * Return the packet that was received, or NULL if no complete packet is
+ * available. The length of the packet is stored in length. The packet stays
+ * valid until packet_release is called.
+ */
+uint8_t *packet_receive(uint8_t *length);
+
+/*
+ * Release the packet returned by packet_receive, making room for the next one.
+ */
+void packet_release();
+
+#endif
+
+/*
+ * Encode and send a packet. This waits for space in the USART transmit buffer
+ * as needed.
+ */
+void packet_send(const uint8_t *data, size_t length);
+
+#if USART_RECEIVER
+
+/*
+ * Return the number of frames dropped since the last call, because of CRC
+ * errors, USART errors, malformed frames, frames that did not fit into the
+ * buffer, or frames received while a packet had not been released yet.
+ */
+uint16_t packet_dropped();
+
+#endif
+
+#endif /* PLEASANT_PACKET_H */
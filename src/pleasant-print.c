@@ -0,0 +1,240 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "pleasant-usart.h"
+#include "pleasant-print.h"
+
+/* Enough for the 10 digits of a 32-bit value, a decimal point and a leading
+   zero. The precision is limited so that a fixed-point value always fits. */
+#define PRINT_BUFFER_SIZE   12
+#define PRINT_MAX_PRECISION 9
+
+struct print_specification {
+  bool left;
+  bool zero;
+  bool is_long;
+  uint8_t width;
+  uint8_t precision;
+};
+
+static void print_padding(char character, uint8_t count) {
+  while (count--) usart_write(character);
+}
+
+/* Fields ---------------------------------------------------------------------
+ * Numbers are converted into a buffer in reverse order, least significant
+ * digit first, and then written out along with their sign and padding.
+ */
+
+static void print_number(const char *reversed,
+                         uint8_t count,
+                         char sign,
+                         struct print_specification *specification) {
+  uint8_t length = count + (sign ? 1 : 0);
+  uint8_t padding =
+    specification->width > length ? specification->width - length : 0;
+
+  if (!specification->left && !specification->zero) {
+    print_padding(' ', padding);
+  }
+  if (sign) usart_write(sign);
+  if (!specification->left && specification->zero) {
+    print_padding('0', padding);
+  }
+
+  while (count) usart_write(reversed[--count]);
+
+  if (specification->left) print_padding(' ', padding);
+}
+
+static uint8_t print_convert_decimal(char *buffer,
+                                     uint32_t value,
+                                     uint8_t precision) {
+  uint8_t count = 0;
+  uint8_t digits = 0;
+  uint16_t small;
+
+  do {
+    if (digits == precision && digits > 0) buffer[count++] = '.';
+
+    /* Use 16-bit division as soon as the value allows it. */
+    if (value > 0xFFFF) {
+      buffer[count++] = '0' + (value % 10);
+      value /= 10;
+    } else {
+      small = value;
+      buffer[count++] = '0' + (small % 10);
+      value = small / 10;
+    }
+
+    digits++;
+  } while (value != 0 || digits <= precision);
+
+  return count;
+}
+
+static uint8_t print_convert_hexadecimal(char *buffer,
+                                         uint32_t value,
+                                         bool uppercase) {
+  uint8_t count = 0;
+  uint8_t digit;
+
+  do {
+    digit = value & 0x0F;
+    buffer[count++] =
+      digit < 10 ? '0' + digit : (uppercase ? 'A' : 'a') + digit - 10;
+    value >>= 4;
+  } while (value != 0);
+
+  return count;
+}
+
+static void print_string(const char *string,
+                         bool in_program_memory,
+                         struct print_specification *specification) {
+  size_t length = in_program_memory ? strlen_P(string) : strlen(string);
+  uint8_t padding =
+    specification->width > length ? specification->width - length : 0;
+  char character;
+
+  if (!specification->left) print_padding(' ', padding);
+
+  while (1) {
+    character = in_program_memory ? pgm_read_byte(string) : *string;
+    if (character == '\0') break;
+    usart_write(character);
+    string++;
+  }
+
+  if (specification->left) print_padding(' ', padding);
+}
+
+/* API functions ----------------------------------------------------------- */
+
+void print_vP(const char *format, va_list args) {
+  struct print_specification specification;
+  char buffer[PRINT_BUFFER_SIZE];
+  char character;
+  char sign;
+  uint32_t value;
+  int32_t signed_value;
+
+  while ((character = pgm_read_byte(format++)) != '\0') {
+    if (character != '%') {
+      usart_write(character);
+      continue;
+    }
+
+    specification.left = false;
+    specification.zero = false;
+    specification.is_long = false;
+    specification.width = 0;
+    specification.precision = 0;
+
+    character = pgm_read_byte(format++);
+
+    for (;; character = pgm_read_byte(format++)) {
+      if (character == '-')      specification.left = true;
+      else if (character == '0') specification.zero = true;
+      else break;
+    }
+
+    while (character >= '0' && character <= '9') {
+      specification.width = specification.width * 10 + (character - '0');
+      character = pgm_read_byte(format++);
+    }
+
+    if (character == '.') {
+      character = pgm_read_byte(format++);
+      while (character >= '0' && character <= '9') {
+        specification.precision =
+          specification.precision * 10 + (character - '0');
+        character = pgm_read_byte(format++);
+      }
+      if (specification.precision > PRINT_MAX_PRECISION) {
+        specification.precision = PRINT_MAX_PRECISION;
+      }
+    }
+
+    if (character == 'l') {
+      specification.is_long = true;
+      character = pgm_read_byte(format++);
+    }
+
+    sign = 0;
+
+    switch (character) {
+    case 'd':
+      signed_value = specification.is_long
+        ? va_arg(args, int32_t) : va_arg(args, int);
+      if (signed_value < 0) {
+        sign = '-';
+        value = -(uint32_t)signed_value;
+      } else {
+        value = signed_value;
+      }
+      print_number(buffer,
+                   print_convert_decimal(buffer,
+                                         value,
+                                         specification.precision),
+                   sign,
+                   &specification);
+      break;
+
+    case 'u':
+      value = specification.is_long
+        ? va_arg(args, uint32_t) : va_arg(args, unsigned int);
+      print_number(buffer,
+                   print_convert_decimal(buffer,
+                                         value,
+                                         specification.precision),
+                   sign,
+                   &specification);
+      break;
+
+    case 'x':
+    case 'X':
+      value = specification.is_long
+        ? va_arg(args, uint32_t) : va_arg(args, unsigned int);
+      print_number(buffer,
+                   print_convert_hexadecimal(buffer,
+                                             value,
+                                             character == 'X'),
+                   sign,
+                   &specification);
+      break;
+
+    case 'c':
+      buffer[0] = va_arg(args, int);
+      specification.zero = false;
+      print_number(buffer, 1, sign, &specification);
+      break;
+
+    case 's':
+      print_string(va_arg(args, const char *), false, &specification);
+      break;
+
+    case 'S':
+      print_string(va_arg(args, const char *), true, &specification);
+      break;
+
+    case '\0':
+      /* The format string ended in the middle of a conversion. */
+      return;
+
+    default:
+      usart_write(character);
+      break;
+    }
+  }
+}
+
+void print_P(const char *format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  print_vP(format, args);
+  va_end(args);
+}
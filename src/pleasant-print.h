@@ -0,0 +1,48 @@
+/*
+ * Pleasant Print implements a small formatted output function, which writes
+ * directly to Pleasant USART. The format string is read from program memory,
+ * so it does not take up any RAM.
+ *
+ * It is much smaller and faster than printf, but only supports a subset of its
+ * conversions, and interprets the precision of integers differently:
+ *
+ * - %d and %u print a signed or unsigned int, %ld and %lu a long. A precision
+ *   prints the value as a fixed-point number with that many decimals, so
+ *   printing 1234 using %.2d results in "12.34".
+ * - %x and %X print an unsigned int in lowercase or uppercase hexadecimal,
+ *   %lx and %lX an unsigned long.
+ * - %c prints a single character.
+ * - %s prints a string from RAM, and %S a string from program memory.
+ * - %% prints a percent sign.
+ *
+ * A field width can be given for all conversions. The value is padded on the
+ * left with spaces, or with zeroes if the width starts with 0, or on the right
+ * with spaces if the width is preceded by a -.
+ */
+
+#ifndef PLEASANT_PRINT_H
+#define PLEASANT_PRINT_H
+
+#include <stdarg.h>
+#include <avr/pgmspace.h>
+
+/* API functions ----------------------------------------------------------- */
+
+/*
+ * Print a formatted string to the USART. The format string has to be stored in
+ * program memory, e.g. using PSTR.
+ */
+void print_P(const char *format, ...);
+
+/*
+ * Like print_P, but taking its arguments as a va_list.
+ */
+void print_vP(const char *format, va_list args);
+
+/*
+ * Print a formatted string to the USART, with the format string literal
+ * automatically placed in program memory.
+ */
+#define PRINT(format, ...) print_P(PSTR(format), ##__VA_ARGS__)
+
+#endif /* PLEASANT_PRINT_H */
@@ -0,0 +1,460 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "pleasant-timer.h"
+#include "pleasant-soft-usart.h"
+
+#if (SOFT_USART_RX_BUFFER_SIZE & (SOFT_USART_RX_BUFFER_SIZE - 1)) != 0 \
+  || (SOFT_USART_TX_BUFFER_SIZE & (SOFT_USART_TX_BUFFER_SIZE - 1)) != 0
+#error "Soft USART buffer sizes must be powers of two"
+#endif
+
+#define SOFT_USART_RX_MASK (SOFT_USART_RX_BUFFER_SIZE - 1)
+#define SOFT_USART_TX_MASK (SOFT_USART_TX_BUFFER_SIZE - 1)
+
+/* Timer 2 runs at F_CPU / 8, and a bit has to fit in its 8-bit range. */
+#define SOFT_USART_TICKS_PER_SECOND (F_CPU / 8)
+#define SOFT_USART_MIN_BIT_TICKS    32
+#define SOFT_USART_MAX_BIT_TICKS    255
+
+/* Events this close are handled right away rather than scheduled, as the
+   compare match could be missed otherwise. */
+#define SOFT_USART_MARGIN_TICKS 4
+
+/* Ticks between a start bit's edge and reading TCNT2 in the pin change
+   interrupt. */
+#define SOFT_USART_RX_LATENCY_TICKS 2
+
+/* Data bits followed by the stop bit */
+#define SOFT_USART_TX_FRAME_BITS 9
+#define SOFT_USART_TX_STOP_BIT   (1 << 8)
+#define SOFT_USART_RX_STOP_BIT   9
+
+static struct soft_usart *soft_usart_ports[SOFT_USART_MAX_PORTS];
+static uint8_t soft_usart_port_count;
+
+/* Scheduling -----------------------------------------------------------------
+ * Every active direction of every port has the time of its next event. The
+ * compare register for that direction is set to the earliest one, and its
+ * interrupt handles all events that are due.
+ *
+ * Times are 8-bit timer values, so they are compared by their offset from
+ * the time the interrupt was scheduled for, which no pending event lies
+ * before.
+ */
+
+static void soft_usart_schedule(volatile uint8_t *compare,
+                                uint8_t flag,
+                                uint8_t next) {
+  uint8_t now = TCNT2;
+
+  /* A pending interrupt will schedule the event itself. The flag is also set
+     by compare matches while the interrupt is disabled, which don't count. */
+  if ((TIMSK2 & flag) && (TIFR2 & flag)) return;
+
+  if (!(TIMSK2 & flag)
+      || (uint8_t)(next - now) < (uint8_t)(*compare - now)) {
+    *compare = next;
+    TIFR2 = flag;
+    TIMSK2 |= flag;
+  }
+}
+
+static void soft_usart_transmit_bit(struct soft_usart *usart) {
+  uint8_t tail;
+
+  if (usart->tx_bits == 0) {
+    /* The stop bit is done, so start the next byte, if any. */
+    tail = usart->tx_tail;
+    if (tail == usart->tx_head) {
+      usart->tx_active = false;
+      return;
+    }
+
+    *usart->tx_port &= ~usart->tx_mask;
+    usart->tx_shift = usart->tx_buffer[tail] | SOFT_USART_TX_STOP_BIT;
+    usart->tx_bits = SOFT_USART_TX_FRAME_BITS;
+    usart->tx_tail = (tail + 1) & SOFT_USART_TX_MASK;
+  } else {
+    if (usart->tx_shift & 1) *usart->tx_port |= usart->tx_mask;
+    else *usart->tx_port &= ~usart->tx_mask;
+    usart->tx_shift >>= 1;
+    usart->tx_bits--;
+  }
+
+  usart->tx_next += usart->bit_ticks;
+}
+
+static void soft_usart_receive_bit(struct soft_usart *usart) {
+  bool high = *usart->rx_input & usart->rx_mask;
+  uint8_t head, next;
+
+  if (usart->rx_bit == 0 && high) {
+    /* Too short to be a start bit */
+    usart->rx_active = false;
+  } else if (usart->rx_bit < SOFT_USART_RX_STOP_BIT) {
+    usart->rx_shift >>= 1;
+    if (high && usart->rx_bit > 0) usart->rx_shift |= 0x80;
+    usart->rx_bit++;
+  } else {
+    head = usart->rx_head;
+    next = (head + 1) & SOFT_USART_RX_MASK;
+
+    if (next != usart->rx_tail) {
+      usart->rx_buffer[head] = usart->rx_shift;
+      usart->rx_error_buffer[head] =
+        (high ? USART_ERROR_NO_ERROR : USART_ERROR_FRAME_ERROR)
+        | (usart->rx_lost ? USART_ERROR_DATA_OVERRUN : 0);
+      usart->rx_head = next;
+      usart->rx_lost = false;
+    } else {
+      usart->rx_lost = true;
+    }
+
+    usart->rx_active = false;
+  }
+
+  if (usart->rx_active) {
+    usart->rx_next += usart->bit_ticks;
+  } else {
+    usart->rx_high = high;
+    *usart->rx_pin_change_mask |= usart->rx_mask;
+  }
+}
+
+static inline void soft_usart_service(bool receive) {
+  volatile uint8_t *compare = receive ? &OCR2B : &OCR2A;
+  uint8_t flag = receive ? (1 << OCF2B) : (1 << OCF2A);
+  uint8_t base = *compare;
+  uint8_t earliest, offset, i;
+  uint16_t due;
+  bool active;
+  struct soft_usart *usart;
+
+  for (;;) {
+    due = (uint8_t)(TCNT2 - base) + SOFT_USART_MARGIN_TICKS;
+    earliest = 0xFF;
+    active = false;
+
+    for (i = 0; i < soft_usart_port_count; i++) {
+      usart = soft_usart_ports[i];
+
+      if (!(receive ? usart->rx_active : usart->tx_active)) continue;
+
+      offset = (receive ? usart->rx_next : usart->tx_next) - base;
+      if (offset <= due) {
+        if (receive) soft_usart_receive_bit(usart);
+        else soft_usart_transmit_bit(usart);
+
+        if (!(receive ? usart->rx_active : usart->tx_active)) continue;
+        offset = (receive ? usart->rx_next : usart->tx_next) - base;
+      }
+
+      active = true;
+      if (offset < earliest) earliest = offset;
+    }
+
+    if (!active) {
+      TIMSK2 &= ~flag;
+      return;
+    }
+
+    /* Otherwise an event became due while handling the others. */
+    if ((uint8_t)(TCNT2 - base) + SOFT_USART_MARGIN_TICKS < earliest) {
+      *compare = base + earliest;
+      TIFR2 = flag;
+      return;
+    }
+  }
+}
+
+ISR(TIMER2_COMPA_vect) {
+  soft_usart_service(false);
+}
+
+ISR(TIMER2_COMPB_vect) {
+  soft_usart_service(true);
+}
+
+/* Start bits -----------------------------------------------------------------
+ * Pin change interrupts are enabled for the RX pins of idle ports. A falling
+ * edge schedules the first sample in the middle of the start bit, and stops
+ * the pin change interrupt until the stop bit.
+ */
+
+ISR(PCINT0_vect) {
+  uint8_t now = TCNT2;
+  uint8_t i;
+  bool high;
+  struct soft_usart *usart;
+
+  for (i = 0; i < soft_usart_port_count; i++) {
+    usart = soft_usart_ports[i];
+
+    if (!usart->rx_input || usart->rx_active) continue;
+
+    high = *usart->rx_input & usart->rx_mask;
+    if (usart->rx_high && !high) {
+      *usart->rx_pin_change_mask &= ~usart->rx_mask;
+      usart->rx_bit = 0;
+      usart->rx_active = true;
+      usart->rx_next =
+        now - SOFT_USART_RX_LATENCY_TICKS + usart->bit_ticks / 2;
+      soft_usart_schedule(&OCR2B, (1 << OCF2B), usart->rx_next);
+    }
+    usart->rx_high = high;
+  }
+}
+
+ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
+
+/* API functions ----------------------------------------------------------- */
+
+/* Find the pin change interrupt group of an input register. Returns false if
+   it has none. */
+static bool soft_usart_pin_change_group(volatile uint8_t *input,
+                                        volatile uint8_t **mask,
+                                        uint8_t *enable) {
+  if (input == &PINB) {
+    *mask = &PCMSK0;
+    *enable = (1 << PCIE0);
+  } else if (input == &PINC) {
+    *mask = &PCMSK1;
+    *enable = (1 << PCIE1);
+  } else if (input == &PIND) {
+    *mask = &PCMSK2;
+    *enable = (1 << PCIE2);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static void soft_usart_init_rx(struct soft_usart *usart,
+                               volatile uint8_t *ddr,
+                               volatile uint8_t *port,
+                               volatile uint8_t *input,
+                               uint8_t pin,
+                               volatile uint8_t *pin_change_mask,
+                               uint8_t pin_change_enable) {
+  usart->rx_input = NULL;
+  usart->rx_active = false;
+  usart->rx_head = usart->rx_tail = 0;
+  usart->rx_lost = false;
+
+  if (!port) return;
+
+  usart->rx_mask = (1 << pin);
+  usart->rx_input = input;
+  usart->rx_pin_change_mask = pin_change_mask;
+
+  /* Input with pull-up */
+  *ddr &= ~usart->rx_mask;
+  *port |= usart->rx_mask;
+  usart->rx_high = *usart->rx_input & usart->rx_mask;
+
+  PCICR |= pin_change_enable;
+  *usart->rx_pin_change_mask |= usart->rx_mask;
+}
+
+static void soft_usart_init_tx(struct soft_usart *usart,
+                               volatile uint8_t *ddr,
+                               volatile uint8_t *port,
+                               uint8_t pin) {
+  usart->tx_port = port;
+  usart->tx_active = false;
+  usart->tx_head = usart->tx_tail = 0;
+
+  if (!port) return;
+
+  usart->tx_mask = (1 << pin);
+
+  /* Output, idle high */
+  *port |= usart->tx_mask;
+  *ddr |= usart->tx_mask;
+}
+
+bool soft_usart_init(struct soft_usart *usart,
+                     uint32_t baud_rate,
+                     volatile uint8_t *rx_ddr,
+                     volatile uint8_t *rx_port,
+                     volatile uint8_t *rx_input,
+                     uint8_t rx_pin,
+                     volatile uint8_t *tx_ddr,
+                     volatile uint8_t *tx_port,
+                     uint8_t tx_pin) {
+  uint32_t bit_ticks =
+    (SOFT_USART_TICKS_PER_SECOND + baud_rate / 2) / baud_rate;
+  volatile uint8_t *pin_change_mask = NULL;
+  uint8_t pin_change_enable = 0;
+  uint8_t i;
+
+  if (bit_ticks < SOFT_USART_MIN_BIT_TICKS
+      || bit_ticks > SOFT_USART_MAX_BIT_TICKS) {
+    return false;
+  }
+
+  if (rx_port
+      && !soft_usart_pin_change_group(rx_input,
+                                      &pin_change_mask,
+                                      &pin_change_enable)) {
+    return false;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for (i = 0; i < soft_usart_port_count; i++) {
+      if (soft_usart_ports[i] == usart) break;
+    }
+
+    if (i == soft_usart_port_count) {
+      if (soft_usart_port_count == SOFT_USART_MAX_PORTS) return false;
+      soft_usart_ports[soft_usart_port_count++] = usart;
+    }
+
+    if (soft_usart_port_count == 1) {
+      timer2_init(TIMER_WAVE_TYPE_NORMAL,
+                  TIMER_WRAP_TYPE_8_BITS,
+                  TIMER_CLOCK_SOURCE_DIV_8,
+                  TIMER_INTERRUPT_OFF,
+                  TIMER_COMPARE_OUTPUT_MODE_OFF,
+                  TIMER_COMPARE_OUTPUT_MODE_OFF);
+    }
+
+    usart->bit_ticks = bit_ticks;
+    soft_usart_init_rx(usart, rx_ddr, rx_port, rx_input, rx_pin,
+                       pin_change_mask, pin_change_enable);
+    soft_usart_init_tx(usart, tx_ddr, tx_port, tx_pin);
+  }
+
+  return true;
+}
+
+bool soft_usart_try_write(struct soft_usart *usart, uint8_t byte) {
+  uint8_t head = usart->tx_head;
+  uint8_t next = (head + 1) & SOFT_USART_TX_MASK;
+
+  if (next == usart->tx_tail) return false;
+
+  usart->tx_buffer[head] = byte;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart->tx_head = next;
+
+    if (!usart->tx_active) {
+      /* Start as if a stop bit just ended. */
+      usart->tx_bits = 0;
+      usart->tx_active = true;
+      usart->tx_next = TCNT2 + 2 * SOFT_USART_MARGIN_TICKS;
+      soft_usart_schedule(&OCR2A, (1 << OCF2A), usart->tx_next);
+    }
+  }
+
+  return true;
+}
+
+void soft_usart_write(struct soft_usart *usart, uint8_t byte) {
+  while (!soft_usart_try_write(usart, byte));
+}
+
+bool soft_usart_try_read(struct soft_usart *usart,
+                         uint8_t *byte,
+                         enum usart_error *error) {
+  uint8_t tail = usart->rx_tail;
+
+  if (tail == usart->rx_head) return false;
+
+  *byte = usart->rx_buffer[tail];
+  *error = usart->rx_error_buffer[tail];
+  usart->rx_tail = (tail + 1) & SOFT_USART_RX_MASK;
+
+  return true;
+}
+
+uint8_t soft_usart_read(struct soft_usart *usart, enum usart_error *error) {
+  uint8_t byte;
+
+  while (!soft_usart_try_read(usart, &byte, error));
+  return byte;
+}
+
+void soft_usart_write_bytes(struct soft_usart *usart,
+                            const uint8_t *bytes,
+                            size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    soft_usart_write(usart, *(bytes + i));
+  }
+}
+
+size_t soft_usart_try_write_bytes(struct soft_usart *usart,
+                                  const uint8_t *bytes,
+                                  size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!soft_usart_try_write(usart, *(bytes + i))) break;
+  }
+
+  return i;
+}
+
+void soft_usart_read_bytes(struct soft_usart *usart,
+                           uint8_t *bytes,
+                           size_t count,
+                           enum usart_error *error) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    *(bytes + i) = soft_usart_read(usart, error);
+    if (*error != USART_ERROR_NO_ERROR) return;
+  }
+}
+
+void soft_usart_write_string(struct soft_usart *usart,
+                             const char *characters) {
+  while (*characters != '\0') {
+    soft_usart_write(usart, *characters);
+    characters++;
+  }
+}
+
+void soft_usart_read_string(struct soft_usart *usart,
+                            char *characters,
+                            size_t max,
+                            enum usart_error *error) {
+  size_t i;
+
+  if (max < 1) return;
+
+  for (i = 0; i < (max - 1); i++) {
+    *(characters + i) = soft_usart_read(usart, error);
+    if (*error != USART_ERROR_NO_ERROR) return;
+
+    if (*(characters + i) == '\n') {
+      *(characters + i) = '\0';
+
+      if (i > 0 && *(characters + i - 1) == '\r')
+        *(characters + i - 1) = '\0';
+
+      return;
+    }
+  }
+
+  *(characters + i) = '\0';
+}
+
+bool soft_usart_byte_available(struct soft_usart *usart) {
+  return usart->rx_head != usart->rx_tail;
+}
+
+uint8_t soft_usart_bytes_available(struct soft_usart *usart) {
+  return (usart->rx_head - usart->rx_tail) & SOFT_USART_RX_MASK;
+}
+
+void soft_usart_flush(struct soft_usart *usart) {
+  /* A port stays active until the stop bit of its last byte has ended. */
+  while (usart->tx_active);
+}
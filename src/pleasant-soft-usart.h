@@ -0,0 +1,182 @@
+/*
+ * Pleasant Soft USART provides additional serial ports on arbitrary pins,
+ * implemented in software. Its API mirrors that of Pleasant USART, with every
+ * function taking the port to operate on as its first argument.
+ *
+ * Bit timing is done by timer 2, which runs freely and is shared by all
+ * ports: its compare A interrupt sends bits, and its compare B interrupt
+ * samples them. Each interrupt is scheduled for whichever port needs it
+ * first. The start of a received byte is detected by a pin change interrupt,
+ * after which reception is done entirely by the timer.
+ *
+ * Frames always have 8 data bits, no parity and 1 stop bit. At 16 MHz, baud
+ * rates from 9600 to 57600 are supported. A single port works at 38400 baud
+ * in full duplex, but the interrupts of several busy ports add up, so using
+ * more of them requires lower baud rates. Other interrupts delay the bit
+ * timing, and should be kept short.
+ *
+ * Pleasant Soft USART takes over timer 2 and all three pin change interrupt
+ * vectors. Note that this does not globally enable interrupts using sei(),
+ * which you will have to do for the library to function.
+ */
+
+#ifndef PLEASANT_SOFT_USART_H
+#define PLEASANT_SOFT_USART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "pleasant-usart.h"
+
+/* Settings -------------------------------------------------------------------
+ * The maximum number of ports, and the sizes of each port's receive and
+ * transmit buffers. Buffer sizes have to be powers of two, no larger than 128.
+ */
+
+#define SOFT_USART_MAX_PORTS 3
+
+#define SOFT_USART_RX_BUFFER_SIZE 32
+#define SOFT_USART_TX_BUFFER_SIZE 32
+
+/* Ports ----------------------------------------------------------------------
+ * Each port is described by a soft_usart structure, which should be
+ * considered opaque. It is set up by soft_usart_init, and has to stay valid
+ * afterwards, so it should not be allocated on the stack.
+ */
+
+struct soft_usart {
+  uint8_t bit_ticks;
+
+  volatile uint8_t *rx_input;
+  volatile uint8_t *rx_pin_change_mask;
+  uint8_t rx_mask;
+  volatile bool rx_active;
+  volatile bool rx_high;
+  volatile uint8_t rx_next;
+  uint8_t rx_bit;
+  uint8_t rx_shift;
+  volatile uint8_t rx_buffer[SOFT_USART_RX_BUFFER_SIZE];
+  volatile uint8_t rx_error_buffer[SOFT_USART_RX_BUFFER_SIZE];
+  volatile uint8_t rx_head;
+  volatile uint8_t rx_tail;
+  volatile bool rx_lost;
+
+  volatile uint8_t *tx_port;
+  uint8_t tx_mask;
+  volatile bool tx_active;
+  volatile uint8_t tx_next;
+  uint8_t tx_bits;
+  uint16_t tx_shift;
+  volatile uint8_t tx_buffer[SOFT_USART_TX_BUFFER_SIZE];
+  volatile uint8_t tx_head;
+  volatile uint8_t tx_tail;
+};
+
+/* API functions ----------------------------------------------------------- */
+
+/*
+ * Set up a port with the specified baud rate. The RX pin is specified by its
+ * DDR, PORT and PIN registers and its pin number (e.g. &DDRD, &PORTD, &PIND,
+ * PORTD2), and the TX pin by its DDR and PORT registers and its pin number.
+ * Either direction can be left out by passing NULL as its port, in which case
+ * its other registers are ignored. The RX pin has its pull-up enabled, and
+ * the TX pin is driven high while idle.
+ *
+ * Returns false if the baud rate is not supported, if the RX pin is not on
+ * port B, C or D, or if SOFT_USART_MAX_PORTS ports have already been set up.
+ */
+bool soft_usart_init(struct soft_usart *usart,
+                     uint32_t baud_rate,
+                     volatile uint8_t *rx_ddr,
+                     volatile uint8_t *rx_port,
+                     volatile uint8_t *rx_input,
+                     uint8_t rx_pin,
+                     volatile uint8_t *tx_ddr,
+                     volatile uint8_t *tx_port,
+                     uint8_t tx_pin);
+
+/*
+ * Write a single byte to the port. If the transmit buffer is full, this waits
+ * until there is space.
+ */
+void soft_usart_write(struct soft_usart *usart, uint8_t byte);
+
+/*
+ * Write a single byte to the port if there is space in the transmit buffer.
+ * Returns false, without writing, if the buffer is full.
+ */
+bool soft_usart_try_write(struct soft_usart *usart, uint8_t byte);
+
+/*
+ * Read a single byte from the port. If the receive buffer is empty, this
+ * waits until a byte is received.
+ */
+uint8_t soft_usart_read(struct soft_usart *usart, enum usart_error *error);
+
+/*
+ * Read a single byte from the port if one is available. Returns false,
+ * without touching byte or error, if the receive buffer is empty. Only frame
+ * errors and data overruns are reported. Errors are stored with the byte they
+ * belong to, and a data overrun is reported with the first byte stored after
+ * bytes were lost.
+ */
+bool soft_usart_try_read(struct soft_usart *usart,
+                         uint8_t *byte,
+                         enum usart_error *error);
+
+/*
+ * Write a number of bytes to the port, waiting for space in the transmit
+ * buffer as needed.
+ */
+void soft_usart_write_bytes(struct soft_usart *usart,
+                            const uint8_t *bytes,
+                            size_t count);
+
+/*
+ * Write as many of the bytes as fit into the transmit buffer, without waiting.
+ * Returns the number of bytes written.
+ */
+size_t soft_usart_try_write_bytes(struct soft_usart *usart,
+                                  const uint8_t *bytes,
+                                  size_t count);
+
+/*
+ * Read a number of bytes from the port. Will return when count bytes have
+ * been read, or when an error occurs.
+ */
+void soft_usart_read_bytes(struct soft_usart *usart,
+                           uint8_t *bytes,
+                           size_t count,
+                           enum usart_error *error);
+
+/*
+ * Write a string to the port. Writing will end before the first \0
+ * encountered.
+ */
+void soft_usart_write_string(struct soft_usart *usart,
+                             const char *characters);
+
+/*
+ * Read a string from the port, in the same way as usart_read_string.
+ */
+void soft_usart_read_string(struct soft_usart *usart,
+                            char *characters,
+                            size_t max,
+                            enum usart_error *error);
+
+/*
+ * Check if a byte is available from the port.
+ */
+bool soft_usart_byte_available(struct soft_usart *usart);
+
+/*
+ * Return the number of bytes in the receive buffer.
+ */
+uint8_t soft_usart_bytes_available(struct soft_usart *usart);
+
+/*
+ * Wait until all bytes in the transmit buffer have been sent completely.
+ */
+void soft_usart_flush(struct soft_usart *usart);
+
+#endif /* PLEASANT_SOFT_USART_H */
@@ -2,15 +2,161 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include "pleasant-spi.h"
 
 bool spi_prepared = false;
 bool spi_configured = false;
 
+/* The device whose configuration is currently loaded into the SPI registers,
+   or NULL if the registers were configured in some other way. */
+static struct spi_device *spi_active_device = NULL;
+
+static void spi_activate_device(struct spi_device *device) {
+  if (device == spi_active_device) return;
+
+  SPCR = device->spcr;
+  SPSR = device->spsr;
+
+  spi_active_device = device;
+  spi_configured = true;
+}
+
+static void spi_select_pin(struct spi_device *device) {
+  if (device->cs_port) *device->cs_port &= ~device->cs_mask;
+}
+
+static void spi_deselect_pin(struct spi_device *device) {
+  if (device->cs_port) *device->cs_port |= device->cs_mask;
+}
+
+/* Slave buffers --------------------------------------------------------------
+ * The slave buffers are ring buffers, with head being the next index to be
+ * written and tail the next index to be read. One entry is always left empty,
+ * so that a full buffer can be told apart from an empty one.
+ */
+
+#if (SPI_SLAVE_RX_BUFFER_SIZE & (SPI_SLAVE_RX_BUFFER_SIZE - 1)) != 0 \
+  || (SPI_SLAVE_TX_BUFFER_SIZE & (SPI_SLAVE_TX_BUFFER_SIZE - 1)) != 0
+#error "SPI slave buffer sizes must be powers of two"
+#endif
+
+#define SPI_SLAVE_RX_MASK (SPI_SLAVE_RX_BUFFER_SIZE - 1)
+#define SPI_SLAVE_TX_MASK (SPI_SLAVE_TX_BUFFER_SIZE - 1)
+
+static volatile uint8_t spi_slave_rx_buffer[SPI_SLAVE_RX_BUFFER_SIZE];
+static volatile uint8_t spi_slave_rx_head;
+static volatile uint8_t spi_slave_rx_tail;
+
+static volatile uint8_t spi_slave_tx_buffer[SPI_SLAVE_TX_BUFFER_SIZE];
+static volatile uint8_t spi_slave_tx_head;
+static volatile uint8_t spi_slave_tx_tail;
+
+static volatile uint8_t spi_slave_reply = SPI_SLAVE_DEFAULT_REPLY;
+static volatile bool spi_slave_overflow;
+
+static inline void spi_slave_transfer_complete() {
+  uint8_t tail = spi_slave_tx_tail;
+  uint8_t head = spi_slave_rx_head;
+  uint8_t next = (head + 1) & SPI_SLAVE_RX_MASK;
+
+  /* The master may start the next byte at any time, so SPDR is loaded first.
+     The received byte stays available in the receive buffer meanwhile. */
+  if (tail != spi_slave_tx_head) {
+    SPDR = spi_slave_tx_buffer[tail];
+    spi_slave_tx_tail = (tail + 1) & SPI_SLAVE_TX_MASK;
+  } else {
+    SPDR = spi_slave_reply;
+  }
+
+  if (next != spi_slave_rx_tail) {
+    spi_slave_rx_buffer[head] = SPDR;
+    spi_slave_rx_head = next;
+  } else {
+    (void)SPDR;
+    spi_slave_overflow = true;
+  }
+}
+
+/* Transaction queue ----------------------------------------------------------
+ * Queued transactions are kept in a ring buffer. The transaction at the head
+ * of the queue is the one currently being transferred by the interrupt.
+ */
+
+static struct spi_transaction *volatile spi_queue[SPI_QUEUE_SIZE];
+static volatile uint8_t spi_queue_head;
+static volatile uint8_t spi_queue_count;
+static volatile size_t spi_queue_head_index;
+
+static uint8_t spi_transaction_byte(struct spi_transaction *transaction,
+                                    size_t index) {
+  return transaction->tx ? transaction->tx[index] : SPI_FILL_BYTE;
+}
+
+static void spi_start_transaction(struct spi_transaction *transaction) {
+  transaction->state = SPI_TRANSACTION_STATE_ACTIVE;
+  if (transaction->device) {
+    spi_activate_device(transaction->device);
+    spi_select_pin(transaction->device);
+  }
+  if (transaction->select) transaction->select(true);
+
+  spi_queue_head_index = 0;
+  SPCR |= (1 << SPIE);
+  SPDR = spi_transaction_byte(transaction, 0);
+}
+
+ISR(SPI_STC_vect) {
+  struct spi_transaction *transaction;
+  size_t index;
+  uint8_t received;
+
+  if (!(SPCR & (1 << MSTR))) {
+    spi_slave_transfer_complete();
+    return;
+  }
+
+  transaction = spi_queue[spi_queue_head];
+  index = spi_queue_head_index;
+  received = SPDR;
+
+  if (transaction->rx) transaction->rx[index] = received;
+  index++;
+
+  if (index < transaction->length) {
+    SPDR = spi_transaction_byte(transaction, index);
+    spi_queue_head_index = index;
+    return;
+  }
+
+  if (transaction->select) transaction->select(false);
+  if (transaction->device) spi_deselect_pin(transaction->device);
+  transaction->state = SPI_TRANSACTION_STATE_DONE;
+
+  spi_queue_head = (spi_queue_head + 1) % SPI_QUEUE_SIZE;
+  spi_queue_count--;
+
+  if (spi_queue_count > 0) {
+    spi_start_transaction(spi_queue[spi_queue_head]);
+  } else {
+    SPCR &= ~(1 << SPIE);
+  }
+
+  /* The callback is called last, so it can submit a new transaction. */
+  if (transaction->callback) transaction->callback(transaction);
+}
+
+/* API functions ----------------------------------------------------------- */
+
 void spi_prepare() {
   DDRB |= (1 << PORTB2);            /* SS: Slave Select */
+  SPCR &= ~(1 << SPIE);             /* Leave slave operation, if needed */
+  SPCR &= ~SPI_MODE_MASK;           /* Back to mode 0 */
   SPCR |= (1 << MSTR) | (1 << SPE); /* Enable SPI in master mode */
   DDRB |= (1 << PORTB5);            /* SCK, Serial ClocK */
+  DDRB &= ~(1 << PORTB4);           /* MISO: Master In Slave Out */
   DDRB |= (1 << PORTB3);            /* MOSI: Master Out Slave In */
 
   spi_prepared = true;
@@ -30,22 +176,250 @@ void spi_configure(enum spi_clock_speed clock_speed,
   SPCR &= ~SPI_BIT_ORDER_MASK;
   SPCR |= bit_order;
 
+  spi_active_device = NULL;
   spi_configured = true;
 }
 
-uint8_t spi_transfer(uint8_t data) {
+void spi_device_init(struct spi_device *device,
+                     enum spi_clock_speed clock_speed,
+                     enum spi_bit_order bit_order,
+                     enum spi_mode mode,
+                     volatile uint8_t *cs_ddr,
+                     volatile uint8_t *cs_port,
+                     uint8_t cs_pin) {
+  if (!spi_prepared) spi_prepare();
+
+  device->spcr =
+    (1 << SPE)
+    | (1 << MSTR)
+    | ((clock_speed & (1 << 1)) ? (1 << SPR1) : 0)
+    | ((clock_speed & (1 << 0)) ? (1 << SPR0) : 0)
+    | bit_order
+    | mode;
+  device->spsr = (clock_speed & (1 << 2)) ? (1 << SPI2X) : 0;
+
+  device->cs_port = cs_port;
+  device->cs_mask = (1 << cs_pin);
+
+  if (cs_port) {
+    *cs_ddr |= device->cs_mask;
+    spi_deselect_pin(device);
+  }
+
+  /* The registers may still hold an older version of this device. */
+  if (device == spi_active_device) spi_active_device = NULL;
+}
+
+void spi_select(struct spi_device *device) {
+  if (!spi_prepared) spi_prepare();
+  spi_wait();
+  spi_activate_device(device);
+  spi_select_pin(device);
+}
+
+void spi_deselect(struct spi_device *device) {
+  spi_deselect_pin(device);
+}
+
+/* Slave operation --------------------------------------------------------- */
+
+void spi_slave_init(enum spi_bit_order bit_order, enum spi_mode mode) {
+  spi_wait();
+
+  DDRB &= ~((1 << PORTB2) | (1 << PORTB3) | (1 << PORTB5));
+  DDRB |= (1 << PORTB4);            /* MISO: Master In Slave Out */
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    spi_slave_rx_head = spi_slave_rx_tail = 0;
+    spi_slave_tx_head = spi_slave_tx_tail = 0;
+    spi_slave_overflow = false;
+
+    SPCR = (1 << SPE) | (1 << SPIE) | bit_order | mode;
+    SPDR = spi_slave_reply;
+  }
+
+  spi_prepared = false;
+  spi_configured = false;
+  spi_active_device = NULL;
+}
+
+void spi_slave_set_reply(uint8_t reply) {
+  spi_slave_reply = reply;
+}
+
+bool spi_slave_write(uint8_t byte) {
+  uint8_t head = spi_slave_tx_head;
+  uint8_t next = (head + 1) & SPI_SLAVE_TX_MASK;
+
+  if (next == spi_slave_tx_tail) return false;
+
+  spi_slave_tx_buffer[head] = byte;
+  spi_slave_tx_head = next;
+  return true;
+}
+
+size_t spi_slave_write_bytes(const uint8_t *bytes, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!spi_slave_write(*(bytes + i))) break;
+  }
+
+  return i;
+}
+
+bool spi_slave_read(uint8_t *byte) {
+  uint8_t tail = spi_slave_rx_tail;
+
+  if (tail == spi_slave_rx_head) return false;
+
+  *byte = spi_slave_rx_buffer[tail];
+  spi_slave_rx_tail = (tail + 1) & SPI_SLAVE_RX_MASK;
+  return true;
+}
+
+uint8_t spi_slave_available() {
+  return (spi_slave_rx_head - spi_slave_rx_tail) & SPI_SLAVE_RX_MASK;
+}
+
+bool spi_slave_overflowed() {
+  bool overflow;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    overflow = spi_slave_overflow;
+    spi_slave_overflow = false;
+  }
+
+  return overflow;
+}
+
+/* Synchronous transfers ------------------------------------------------------
+ * The bulk functions below prefetch the next byte before waiting for the
+ * current one to finish, so SPDR can be loaded as soon as SPIF is set.
+ * Reading SPSR with SPIF set and then accessing SPDR clears SPIF, so no
+ * separate read is needed when the received byte is not used.
+ */
+
+static void spi_prepare_transfer() {
   if (!spi_configured) spi_configure(SPI_DEFAULT_CLOCK_SPEED,
                                      SPI_DEFAULT_BIT_ORDER);
+  spi_wait();
+}
 
-  SPDR = data;
+static void spi_wait_transfer() {
   while (!(SPSR & (1 << SPIF)));
+}
+
+uint8_t spi_transfer(uint8_t data) {
+  spi_prepare_transfer();
+
+  SPDR = data;
+  spi_wait_transfer();
   return SPDR;
 }
 
 void spi_transfer_bytes(uint8_t *bytes, size_t count) {
-  size_t i;
+  uint8_t next, received;
 
-  for (i = 0; i < count; i++) {
-    *(bytes + i) = spi_transfer(*(bytes + i));
+  if (count == 0) return;
+  spi_prepare_transfer();
+
+  SPDR = *bytes;
+  while (--count) {
+    next = *(bytes + 1);
+    spi_wait_transfer();
+    received = SPDR;
+    SPDR = next;
+    *bytes++ = received;
+  }
+
+  spi_wait_transfer();
+  *bytes = SPDR;
+}
+
+void spi_write_bytes(const uint8_t *bytes, size_t count) {
+  uint8_t next;
+
+  if (count == 0) return;
+  spi_prepare_transfer();
+
+  SPDR = *bytes++;
+  while (--count) {
+    next = *bytes++;
+    spi_wait_transfer();
+    SPDR = next;
+  }
+
+  spi_wait_transfer();
+}
+
+void spi_read_bytes(uint8_t *bytes, size_t count, uint8_t fill) {
+  uint8_t received;
+
+  if (count == 0) return;
+  spi_prepare_transfer();
+
+  SPDR = fill;
+  while (--count) {
+    spi_wait_transfer();
+    received = SPDR;
+    SPDR = fill;
+    *bytes++ = received;
+  }
+
+  spi_wait_transfer();
+  *bytes = SPDR;
+}
+
+/* Read a byte from flash and advance the address, using a single
+   post-incrementing lpm instruction. */
+static inline uint8_t spi_pgm_read_byte_inc(const uint8_t **address) {
+  uint8_t byte;
+  __asm__ __volatile__ ("lpm %0, Z+" : "=r" (byte), "+z" (*address));
+  return byte;
+}
+
+void spi_write_bytes_P(const uint8_t *bytes, size_t count) {
+  uint8_t next;
+
+  if (count == 0) return;
+  spi_prepare_transfer();
+
+  SPDR = spi_pgm_read_byte_inc(&bytes);
+  while (--count) {
+    next = spi_pgm_read_byte_inc(&bytes);
+    spi_wait_transfer();
+    SPDR = next;
   }
+
+  spi_wait_transfer();
+}
+
+/* Asynchronous transfers -------------------------------------------------- */
+
+bool spi_submit(struct spi_transaction *transaction) {
+  if (!spi_configured) spi_configure(SPI_DEFAULT_CLOCK_SPEED,
+                                     SPI_DEFAULT_BIT_ORDER);
+  if (transaction->length == 0) return false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (spi_queue_count == SPI_QUEUE_SIZE) return false;
+
+    transaction->state = SPI_TRANSACTION_STATE_QUEUED;
+    spi_queue[(spi_queue_head + spi_queue_count) % SPI_QUEUE_SIZE]
+      = transaction;
+    spi_queue_count++;
+
+    if (spi_queue_count == 1) spi_start_transaction(transaction);
+  }
+
+  return true;
+}
+
+bool spi_busy() {
+  return spi_queue_count > 0;
+}
+
+void spi_wait() {
+  while (spi_busy());
 }
@@ -1,6 +1,11 @@
 /*
  * Pleasant SPI allows you to easily configure and use the device's SPI module.
- * It only supports master operation.
+ * It supports both master and slave operation, though not at the same time.
+ *
+ * Transfers can either be performed synchronously, in which case the function
+ * returns once all data has been transferred, or asynchronously through a
+ * queue of transactions, which is worked through from the SPI interrupt. Note
+ * that asynchronous operation requires interrupts to be enabled using sei().
  */
 
 #ifndef PLEASANT_SPI_H
@@ -42,6 +47,89 @@ enum spi_clock_speed {
   SPI_CLOCK_SPEED_DIV_128  = 0b011
 };
 
+/* Mode -----------------------------------------------------------------------
+ * The SPI mode determines the clock polarity and the clock edge at which data
+ * is sampled. spi_configure leaves the mode untouched, which means mode 0 is
+ * used unless a device with a different mode has been selected.
+ */
+
+#define SPI_MODE_MASK ((1 << CPOL) | (1 << CPHA))
+
+enum spi_mode {
+  SPI_MODE_0 = (0 << CPOL) | (0 << CPHA),
+  SPI_MODE_1 = (0 << CPOL) | (1 << CPHA),
+  SPI_MODE_2 = (1 << CPOL) | (0 << CPHA),
+  SPI_MODE_3 = (1 << CPOL) | (1 << CPHA)
+};
+
+/* Devices --------------------------------------------------------------------
+ * A device describes how to communicate with a single device on the bus: its
+ * clock speed, bit order, mode and chip select pin. The register values are
+ * computed once, by spi_device_init, so that selecting a device only has to
+ * write SPCR and SPSR. When the device is already the active one, the
+ * registers are not touched at all.
+ *
+ * The fields are filled in by spi_device_init and should not be changed
+ * directly.
+ */
+
+struct spi_device {
+  uint8_t spcr;
+  uint8_t spsr;
+  volatile uint8_t *cs_port;
+  uint8_t cs_mask;
+};
+
+/* Asynchronous transactions --------------------------------------------------
+ * A transaction describes a single transfer of length bytes. The bytes sent are
+ * taken from tx, or are SPI_FILL_BYTE if tx is NULL. The bytes received are
+ * stored in rx, or discarded if rx is NULL. tx and rx may point to the same
+ * buffer.
+ *
+ * If device is not NULL, it is selected before the first byte is sent and
+ * deselected after the last byte has been received. If select is not NULL, it
+ * is called with true before the first byte is sent, and with false after the
+ * last byte has been received. This allows chip select pins not described by
+ * a device to be controlled. If callback is not NULL, it is called after the
+ * transaction has completed. Both are called from inside the SPI interrupt, so
+ * they must not use the synchronous transfer functions.
+ *
+ * The transaction, and the buffers it points to, are used directly by the
+ * interrupt and must stay valid until the transaction is done.
+ */
+
+#define SPI_QUEUE_SIZE 4
+#define SPI_FILL_BYTE  0xFF
+
+enum spi_transaction_state {
+  SPI_TRANSACTION_STATE_IDLE,
+  SPI_TRANSACTION_STATE_QUEUED,
+  SPI_TRANSACTION_STATE_ACTIVE,
+  SPI_TRANSACTION_STATE_DONE
+};
+
+struct spi_transaction {
+  const uint8_t *tx;
+  uint8_t *rx;
+  size_t length;
+  struct spi_device *device;
+  void (*select)(bool selected);
+  void (*callback)(struct spi_transaction *transaction);
+  volatile enum spi_transaction_state state;
+};
+
+/* Slave operation ------------------------------------------------------------
+ * As a slave, received bytes are stored in a ring buffer by the SPI interrupt,
+ * and bytes to send are taken from another ring buffer. When the transmit
+ * buffer is empty, the reply byte is sent instead.
+ *
+ * The buffer sizes have to be powers of two, no larger than 128.
+ */
+
+#define SPI_SLAVE_RX_BUFFER_SIZE 32
+#define SPI_SLAVE_TX_BUFFER_SIZE 32
+#define SPI_SLAVE_DEFAULT_REPLY  0x00
+
 /* State ------------------------------------------------------------------- */
 
 #define SPI_DEFAULT_CLOCK_SPEED SPI_CLOCK_SPEED_DIV_64
@@ -77,7 +165,37 @@ void spi_configure(enum spi_clock_speed clock_speed,
                    enum spi_bit_order bit_order);
 
 /*
- * Send a single byte, returning the received byte.
+ * Describe a device on the bus. Its chip select pin, given as a DDR register,
+ * a PORT register and a pin number (e.g. &DDRD, &PORTD, PORTD7), is
+ * configured as an output and driven high. If cs_port is NULL, no chip select
+ * pin is controlled, and cs_ddr is ignored.
+ */
+void spi_device_init(struct spi_device *device,
+                     enum spi_clock_speed clock_speed,
+                     enum spi_bit_order bit_order,
+                     enum spi_mode mode,
+                     volatile uint8_t *cs_ddr,
+                     volatile uint8_t *cs_port,
+                     uint8_t cs_pin);
+
+/*
+ * Make the device the active one, reconfiguring the SPI module only if a
+ * different device (or configuration) was active before, and drive its chip
+ * select pin low. If asynchronous transactions are still queued, this waits
+ * for them to complete first.
+ */
+void spi_select(struct spi_device *device);
+
+/*
+ * Drive the device's chip select pin high again. The device stays the active
+ * one, so selecting it again is cheap.
+ */
+void spi_deselect(struct spi_device *device);
+
+/*
+ * Send a single byte, returning the received byte. If asynchronous
+ * transactions are still queued, this waits for them to complete first. The
+ * same is true for spi_transfer_bytes.
  */
 uint8_t spi_transfer(uint8_t data);
 
@@ -87,4 +205,93 @@ uint8_t spi_transfer(uint8_t data);
  */
 void spi_transfer_bytes(uint8_t *bytes, size_t count);
 
+/*
+ * Send a number of bytes, discarding the bytes received. This is faster than
+ * spi_transfer_bytes, and does not modify the data.
+ */
+void spi_write_bytes(const uint8_t *bytes, size_t count);
+
+/*
+ * Send a number of bytes stored in program memory (PROGMEM), discarding the
+ * bytes received. Each byte is read from flash while the previous one is being
+ * sent, so no copy in RAM is needed.
+ */
+void spi_write_bytes_P(const uint8_t *bytes, size_t count);
+
+/*
+ * Receive a number of bytes, sending the fill byte for each one.
+ */
+void spi_read_bytes(uint8_t *bytes, size_t count, uint8_t fill);
+
+/*
+ * Queue a transaction for asynchronous transfer, and return immediately. If
+ * the queue is full, or the transaction has a length of 0, false is returned
+ * and the transaction is not queued.
+ *
+ * The state of the transaction is updated as it progresses, so completion can
+ * be polled for instead of using a callback.
+ */
+bool spi_submit(struct spi_transaction *transaction);
+
+/*
+ * Check whether any asynchronous transactions are queued or in progress.
+ */
+bool spi_busy();
+
+/*
+ * Wait until all queued asynchronous transactions have completed.
+ */
+void spi_wait();
+
+/* Slave operation --------------------------------------------------------- */
+
+/*
+ * Enable the SPI module as a slave. PORTB4 (MISO) is configured as an output
+ * port, and PORTB5 (SCK), PORTB3 (MOSI) and PORTB2 (SS) as input ports. Both
+ * buffers are emptied. Interrupts have to be enabled using sei().
+ *
+ * The interrupt takes a fixed, short amount of time for every byte, but the
+ * master still has to leave enough time between bytes for it to run. The next
+ * byte is loaded into SPDR before anything else is done.
+ *
+ * To use master operation again afterwards, call spi_configure or select a
+ * device.
+ */
+void spi_slave_init(enum spi_bit_order bit_order, enum spi_mode mode);
+
+/*
+ * Set the byte that is sent when the transmit buffer is empty. It is also the
+ * first byte sent after spi_slave_init.
+ */
+void spi_slave_set_reply(uint8_t reply);
+
+/*
+ * Queue a byte to be sent to the master. Returns false if the transmit buffer
+ * is full.
+ */
+bool spi_slave_write(uint8_t byte);
+
+/*
+ * Queue a number of bytes to be sent to the master. Returns the number of
+ * bytes that fit into the transmit buffer.
+ */
+size_t spi_slave_write_bytes(const uint8_t *bytes, size_t count);
+
+/*
+ * Take a received byte from the receive buffer. Returns false, without
+ * touching byte, if no byte is available.
+ */
+bool spi_slave_read(uint8_t *byte);
+
+/*
+ * Return the number of bytes in the receive buffer.
+ */
+uint8_t spi_slave_available();
+
+/*
+ * Check whether a received byte was dropped because the receive buffer was
+ * full. This resets the condition.
+ */
+bool spi_slave_overflowed();
+
 #endif /* PLEASANT_SPI_H */
@@ -0,0 +1,189 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "pleasant-timer.h"
+#include "pleasant-packet.h"
+#include "pleasant-telemetry.h"
+
+/* Larger tick deltas could be mistaken for ones that wrapped around. */
+#define TELEMETRY_MAX_TICK_DELTA 0x7FFF
+
+/* A batch is closed once another record might not fit into a packet. */
+#define TELEMETRY_MAX_BATCH_DATA_SIZE PACKET_MAX_SIZE
+
+/* Batches ----------------------------------------------------------------- */
+
+struct telemetry_batch {
+  volatile bool ready;
+  uint8_t count;
+  uint8_t size;
+  uint16_t deadline;
+  uint16_t last_timestamp;
+  int16_t last_values[TELEMETRY_CHANNEL_COUNT];
+  uint8_t data[TELEMETRY_MAX_BATCH_DATA_SIZE];
+};
+
+static struct telemetry_batch telemetry_batches[2];
+static volatile uint8_t telemetry_filling;
+static uint8_t telemetry_sequence;
+static uint16_t telemetry_flush_ticks;
+static volatile uint16_t telemetry_dropped_count;
+
+static void telemetry_start_batch(struct telemetry_batch *batch,
+                                  uint16_t timestamp) {
+  uint8_t i;
+
+  batch->count = 0;
+  batch->size = TELEMETRY_HEADER_SIZE;
+  batch->deadline = timestamp + telemetry_flush_ticks;
+  batch->last_timestamp = timestamp;
+  for (i = 0; i < TELEMETRY_CHANNEL_COUNT; i++) batch->last_values[i] = 0;
+
+  batch->data[0] = telemetry_sequence++;
+  batch->data[1] = timestamp & 0xFF;
+  batch->data[2] = timestamp >> 8;
+}
+
+/* Should be called with interrupts disabled. */
+static void telemetry_close_batch() {
+  telemetry_batches[telemetry_filling].ready = true;
+  telemetry_filling ^= 1;
+}
+
+static void telemetry_send_batch(struct telemetry_batch *batch) {
+  if (!batch->ready) return;
+
+  packet_send(batch->data, batch->size);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    batch->count = 0;
+    batch->ready = false;
+  }
+}
+
+/* Store a value as a varint, returning the number of bytes used. */
+static uint8_t telemetry_put_varint(uint8_t *data, uint16_t value) {
+  uint8_t size = 0;
+
+  while (value > 0x7F) {
+    data[size++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  data[size++] = value;
+
+  return size;
+}
+
+static uint16_t telemetry_zigzag(uint16_t difference) {
+  return (difference << 1) ^ -(difference >> 15);
+}
+
+/* API functions ----------------------------------------------------------- */
+
+void telemetry_init(enum timer_clock_source clock_source,
+                    uint16_t flush_ticks) {
+  timer1_init(TIMER_WAVE_TYPE_NORMAL,
+              TIMER_WRAP_TYPE_16_BITS,
+              clock_source,
+              TIMER_INTERRUPT_OFF,
+              TIMER_COMPARE_OUTPUT_MODE_OFF,
+              TIMER_COMPARE_OUTPUT_MODE_OFF,
+              TIMER_DEFAULT_INPUT_CAPTURE_EDGE,
+              TIMER_DEFAULT_INPUT_CAPTURE_NOISE_CANCELER);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    telemetry_batches[0].ready = false;
+    telemetry_batches[0].count = 0;
+    telemetry_batches[1].ready = false;
+    telemetry_batches[1].count = 0;
+    telemetry_filling = 0;
+    telemetry_flush_ticks = flush_ticks;
+    telemetry_dropped_count = 0;
+  }
+}
+
+bool telemetry_record(uint8_t channel, int16_t value) {
+  struct telemetry_batch *batch;
+  uint16_t timestamp;
+  uint16_t delta;
+  uint16_t difference;
+  uint8_t *record;
+
+  if (channel >= TELEMETRY_CHANNEL_COUNT) return false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    timestamp = TIMER1_VALUE;
+    batch = &telemetry_batches[telemetry_filling];
+
+    /* A new batch is started when the time since the previous sample is too
+       long to be stored unambiguously. */
+    if (!batch->ready && batch->count > 0
+        && (uint16_t)(timestamp - batch->last_timestamp)
+           > TELEMETRY_MAX_TICK_DELTA) {
+      telemetry_close_batch();
+      batch = &telemetry_batches[telemetry_filling];
+    }
+
+    if (batch->ready) {
+      telemetry_dropped_count++;
+      return false;
+    }
+
+    if (batch->count == 0) telemetry_start_batch(batch, timestamp);
+
+    delta = timestamp - batch->last_timestamp;
+    difference = (uint16_t)value - (uint16_t)batch->last_values[channel];
+
+    record = &batch->data[batch->size];
+    *record++ = channel;
+    record += telemetry_put_varint(record, delta);
+    record += telemetry_put_varint(record, telemetry_zigzag(difference));
+    batch->size = record - batch->data;
+
+    batch->last_timestamp = timestamp;
+    batch->last_values[channel] = value;
+    batch->count++;
+
+    if (batch->count == TELEMETRY_BATCH_SIZE
+        || batch->size
+           > TELEMETRY_MAX_BATCH_DATA_SIZE - TELEMETRY_MAX_RECORD_SIZE) {
+      telemetry_close_batch();
+    }
+  }
+
+  return true;
+}
+
+void telemetry_poll() {
+  struct telemetry_batch *batch;
+  uint8_t filling;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    batch = &telemetry_batches[telemetry_filling];
+
+    /* The signed difference stays correct when the timer wraps around. */
+    if (!batch->ready && batch->count > 0
+        && (int16_t)(TIMER1_VALUE - batch->deadline) >= 0) {
+      telemetry_close_batch();
+    }
+
+    filling = telemetry_filling;
+  }
+
+  /* If the batch being filled is ready as well, both are, and it is the
+     older one. */
+  telemetry_send_batch(&telemetry_batches[filling]);
+  telemetry_send_batch(&telemetry_batches[filling ^ 1]);
+}
+
+uint16_t telemetry_dropped() {
+  uint16_t dropped;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    dropped = telemetry_dropped_count;
+    telemetry_dropped_count = 0;
+  }
+
+  return dropped;
+}
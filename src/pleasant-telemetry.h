@@ -0,0 +1,81 @@
+/*
+ * Pleasant Telemetry allows samples to be exported at a high rate. Samples are
+ * timestamped, collected into batches, and every batch is sent as a single
+ * packet using Pleasant Packet, with the encoding given to packet_init (COBS
+ * by default).
+ *
+ * Timer 1 is used as a free-running 16-bit counter for the timestamps, so
+ * Pleasant Telemetry can not be used at the same time as Pleasant LCD.
+ *
+ * Every packet has the following format, with all multi-byte values being
+ * little-endian:
+ *
+ * - 1 byte: sequence number, incremented for every batch, so that lost
+ *   batches can be detected.
+ * - 2 bytes: timestamp of the first sample in the batch.
+ * - 3 to 7 bytes per sample, up to TELEMETRY_BATCH_SIZE:
+ *   - 1 byte: channel.
+ *   - 1 to 3 bytes: timer ticks since the previous sample in the batch (0 for
+ *     the first sample), as a varint.
+ *   - 1 to 3 bytes: difference with the previous value of the same channel in
+ *     the batch, or the value itself for the first sample of that channel,
+ *     modulo 2^16, as a zigzag encoded varint.
+ *
+ * Varints are stored 7 bits per byte, least significant bits first. Every
+ * byte except the last has its highest bit set. Tick counts below 128 take a
+ * single byte, and those below 16384 take two. Differences are first zigzag
+ * encoded, mapping 0, -1, 1, -2, ... to 0, 1, 2, 3, ..., so those from -64 to
+ * 63 take a single byte, and those from -8192 to 8191 take two.
+ *
+ * A batch is also sent early when another sample might not fit into a
+ * packet of PACKET_MAX_SIZE bytes, or when the time since the previous sample
+ * is 32768 ticks or more.
+ *
+ * Two batches are kept. While one is being sent, the other one is filled, so
+ * samples can be recorded from interrupts.
+ */
+
+#ifndef PLEASANT_TELEMETRY_H
+#define PLEASANT_TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pleasant-timer.h"
+
+/* Settings ---------------------------------------------------------------- */
+
+#define TELEMETRY_BATCH_SIZE    32
+#define TELEMETRY_CHANNEL_COUNT 8
+
+#define TELEMETRY_HEADER_SIZE     3
+#define TELEMETRY_MAX_RECORD_SIZE 7
+
+/* API functions ----------------------------------------------------------- */
+
+/*
+ * Start timer 1 using the specified clock source, which determines the
+ * duration of a timer tick. A batch that is not full is sent once its first
+ * sample is flush_ticks timer ticks old, which has to be less than 32768.
+ */
+void telemetry_init(enum timer_clock_source clock_source,
+                    uint16_t flush_ticks);
+
+/*
+ * Record a sample on a channel. This can be called from interrupts. Returns
+ * false if the sample was dropped, because the channel is out of range or
+ * because both batches are waiting to be sent.
+ */
+bool telemetry_record(uint8_t channel, int16_t value);
+
+/*
+ * Send any batches that are full, or have reached their deadline. This should
+ * be called regularly from the main loop.
+ */
+void telemetry_poll();
+
+/*
+ * Return the number of samples dropped since the last call.
+ */
+uint16_t telemetry_dropped();
+
+#endif /* PLEASANT_TELEMETRY_H */
@@ -1,57 +1,89 @@
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
 #include <util/twi.h>
 #include "pleasant-twi.h"
 
-/* State ------------------------------------------------------------------- */
+#if !TWI_MASTER && !TWI_SLAVE
+#error "TWI_MASTER and TWI_SLAVE can't both be disabled"
+#endif
 
-static volatile enum twi_state twi_state;
-static volatile enum twi_error twi_error;
-static volatile uint8_t twi_slave_addressing_byte;
+/* Bit rate ---------------------------------------------------------------- */
 
-/* Callbacks --------------------------------------------------------------- */
+#define TWI_BIT_RATE_BASE_CYCLES     16
+#define TWI_BIT_RATE_TWBR_MASK       0xFF
+#define TWI_BIT_RATE_PRESCALER_SHIFT 8
+#define TWI_BIT_RATE_MAX_PRESCALER   3
 
-void (*twi_slave_receive_callback)(volatile uint8_t *data,
-                                   uint8_t size);
-void (*twi_slave_transmit_callback)();
+#define TWI_BIT_RATE_SLOWEST                                                  \
+  (TWI_BIT_RATE_SET_FLAG                                                      \
+   | (TWI_BIT_RATE_MAX_PRESCALER << TWI_BIT_RATE_PRESCALER_SHIFT)             \
+   | TWI_BIT_RATE_TWBR_MASK)
 
-/* Buffers --------------------------------------------------------------------
- * Many operations have to write or read data, but because of the asynchronous
- * nature of the TWI module we need a place to store that data. There are three
- * such buffers, which are used in different situations.
- */
+/* Timeouts ---------------------------------------------------------------- */
 
-/* The master buffer is used when we are the master, and we are sending or
-   receiving data. */
+#define TWI_WATCHDOG_PERIOD_MS 16
 
-static volatile uint8_t twi_master_buffer[TWI_BUFFER_SIZE];
-static volatile uint8_t twi_master_buffer_next_index;
-static volatile uint8_t twi_master_buffer_data_size;
+/* The first watchdog interrupt can come at any time after the last TWI
+   interrupt, so the timeout expires up to one period before
+   TWI_TIMEOUT_MS. */
+#define TWI_TIMEOUT_TICKS (TWI_TIMEOUT_MS / TWI_WATCHDOG_PERIOD_MS)
 
-static void twi_master_buffer_start_reading() {
-  twi_master_buffer_next_index = 0;
-}
+#if TWI_TIMEOUT_MS > 0 && TWI_TIMEOUT_TICKS < 2
+#error "TWI_TIMEOUT_MS has to be 0 or at least 32"
+#endif
 
-static bool twi_master_buffer_data_left() {
-  return twi_master_buffer_next_index < twi_master_buffer_data_size;
-}
+/* A stop condition takes one SCL period. This many polls take about 128 us at
+   16 MHz, which covers SCL frequencies down to about 10 kHz. Slower stops are
+   finished by the watchdog interrupt. */
+#define TWI_STOP_POLLS 255
 
-static uint8_t twi_master_buffer_read() {
-  return twi_master_buffer[twi_master_buffer_next_index++];
-}
+#define TWI_RECOVERY_CLOCKS         9
+#define TWI_RECOVERY_HALF_PERIOD_US 5
 
-static void twi_master_buffer_start_writing(uint8_t size) {
-  twi_master_buffer_next_index = 0;
-  twi_master_buffer_data_size = size;
-}
+/* State ------------------------------------------------------------------- */
 
-static void twi_master_buffer_write(uint8_t byte) {
-  twi_master_buffer[twi_master_buffer_next_index++] = byte;
-}
+static volatile enum twi_state twi_state;
 
-static uint8_t twi_master_buffer_data_written() {
-  return twi_master_buffer_next_index;
-}
+#if TWI_MASTER
+
+/* Queued transactions are kept in a ring buffer. The transaction at the head
+   of the queue is the one in progress while we are the master. */
+static struct twi_transaction *volatile twi_queue[TWI_QUEUE_SIZE];
+static volatile uint8_t twi_queue_head;
+static volatile uint8_t twi_queue_count;
+
+/* The segments of the current master transaction. Data is written from and
+   read into the current segment's buffer directly, through twi_master_data,
+   and the number of bytes left in it is kept in twi_master_segment_left. */
+static const struct twi_segment *twi_master_segments;
+static volatile uint8_t twi_master_segment_count;
+static volatile uint8_t twi_master_segment_index;
+static uint8_t *volatile twi_master_data;
+static volatile uint16_t twi_master_segment_left;
+static volatile uint16_t twi_master_received;
+
+#endif
+
+/* Watchdog periods since the last TWI interrupt, while the bus is in use. */
+static volatile uint8_t twi_timeout_ticks;
+
+#if TWI_SLAVE
+
+/* Callbacks --------------------------------------------------------------- */
+
+void (*twi_slave_receive_callback)(volatile uint8_t *data,
+                                   uint8_t size);
+void (*twi_slave_transmit_callback)();
+
+/* Buffers --------------------------------------------------------------------
+ * As a slave, data has to be stored somewhere while it is being sent or
+ * received. There are two such buffers, which are used in different
+ * situations. As a master, the caller's buffers are used instead.
+ */
 
 /* The slave transmit buffer is used when we are a slave, and we have received
    a request for data. The buffer will be filled by the
@@ -87,13 +119,32 @@ static uint8_t twi_slave_transmit_buffer_data_written() {
   return twi_slave_transmit_buffer_next_index;
 }
 
-/* The slave receive buffer is used when we are a slave, and receive data. Its
-   contents are to be processed by the twi_slave_receive_callback. */
-
-static volatile uint8_t twi_slave_receive_buffer[TWI_BUFFER_SIZE];
+/* The slave receive buffers are used when we are a slave, and receive data.
+   They form a queue of messages, to be processed by
+   twi_slave_receive_callback or read with twi_slave_receive. The message at
+   the head of the queue is the oldest one, and the buffer after the last one
+   is written by the interrupt. While all buffers hold messages, the slave
+   does not acknowledge its address. */
+
+static volatile uint8_t
+twi_slave_receive_buffers[TWI_SLAVE_RECEIVE_QUEUE_SIZE][TWI_BUFFER_SIZE];
+static volatile uint8_t
+twi_slave_receive_sizes[TWI_SLAVE_RECEIVE_QUEUE_SIZE];
+static volatile uint8_t twi_slave_receive_head;
+static volatile uint8_t twi_slave_receive_count;
+
+static volatile uint8_t *twi_slave_receive_buffer;
 static volatile uint8_t twi_slave_receive_buffer_next_index;
+static volatile bool twi_slave_accepting;
+
+/* Messages cut off since twi_slave_truncated_count was last called. */
+static volatile uint8_t twi_slave_truncated;
 
 static void twi_slave_receive_buffer_start_writing() {
+  uint8_t tail = (twi_slave_receive_head + twi_slave_receive_count)
+    % TWI_SLAVE_RECEIVE_QUEUE_SIZE;
+
+  twi_slave_receive_buffer = twi_slave_receive_buffers[tail];
   twi_slave_receive_buffer_next_index = 0;
 }
 
@@ -101,24 +152,92 @@ static void twi_slave_receive_buffer_write(uint8_t byte) {
   twi_slave_receive_buffer[twi_slave_receive_buffer_next_index++] = byte;
 }
 
-static uint8_t twi_slave_receive_buffer_data_written() {
-  return twi_slave_receive_buffer_next_index;
+static bool twi_slave_receive_buffer_space_left() {
+  return twi_slave_receive_count < TWI_SLAVE_RECEIVE_QUEUE_SIZE
+    && twi_slave_receive_buffer_next_index < TWI_BUFFER_SIZE;
 }
 
-static bool twi_slave_receive_buffer_space_left() {
-  return twi_slave_receive_buffer_next_index < TWI_BUFFER_SIZE;
+/* Add the message that was just received to the queue, unless there is no
+   room for it. */
+static void twi_slave_receive_buffer_commit() {
+  uint8_t tail = (twi_slave_receive_head + twi_slave_receive_count)
+    % TWI_SLAVE_RECEIVE_QUEUE_SIZE;
+
+  if (twi_slave_receive_count == TWI_SLAVE_RECEIVE_QUEUE_SIZE) return;
+
+  twi_slave_receive_sizes[tail] = twi_slave_receive_buffer_next_index;
+  twi_slave_receive_count++;
+
+  if (twi_slave_receive_count == TWI_SLAVE_RECEIVE_QUEUE_SIZE) {
+    twi_slave_accepting = false;
+  }
 }
 
-/* Transmission ------------------------------------------------------------ */
+/* Remove the oldest message from the queue. Interrupts have to be disabled. */
+static void twi_slave_receive_buffer_release() {
+  twi_slave_receive_head =
+    (twi_slave_receive_head + 1) % TWI_SLAVE_RECEIVE_QUEUE_SIZE;
+  twi_slave_receive_count--;
+  twi_slave_accepting = true;
+
+  /* If the bus is in use, TWEA is set again once it is released. TWINT is
+     written as zero, so a pending interrupt is left alone. */
+  if (twi_state == TWI_STATE_READY) {
+    TWCR = (TWCR & ~(1 << TWINT)) | (1 << TWEA);
+  }
+}
 
+/* Register map ------------------------------------------------------------ */
+
+static volatile uint8_t *volatile twi_register_map;
+static volatile uint8_t twi_register_map_size;
+static volatile uint8_t twi_register_map_pointer;
+static volatile bool twi_register_map_pointer_written;
+
+/* Store a received byte, returning whether the next one can be accepted. */
+static bool twi_register_map_receive(uint8_t byte) {
+  if (!twi_register_map_pointer_written) {
+    twi_register_map_pointer = byte;
+    twi_register_map_pointer_written = true;
+  } else if (twi_register_map_pointer < twi_register_map_size) {
+    twi_register_map[twi_register_map_pointer++] = byte;
+  }
+
+  return twi_register_map_pointer < twi_register_map_size;
+}
+
+static uint8_t twi_register_map_transmit() {
+  if (twi_register_map_pointer >= twi_register_map_size) {
+    return TWI_REGISTER_MAP_FILL_BYTE;
+  }
+  return twi_register_map[twi_register_map_pointer++];
+}
+
+#endif
+
+/* Transmission ---------------------------------------------------------------
+ * Whenever the bus is not being used by us, TWEA decides whether our slave
+ * address is acknowledged.
+ */
+
+static uint8_t twi_slave_enable() {
+#if TWI_SLAVE
+  return twi_slave_accepting ? (1 << TWEA) : 0;
+#else
+  return 0;
+#endif
+}
+
+#if TWI_MASTER
 static void twi_send_start() {
   TWCR =
     (1 << TWSTA)
     | (1 << TWEN)
     | (1 << TWIE)
-    | (1 << TWEA)
+    | twi_slave_enable()
     | (1 << TWINT);
 }
+#endif
 
 static void twi_continue(bool ack) {
   TWCR =
@@ -128,108 +247,352 @@ static void twi_continue(bool ack) {
     | (ack ? (1 << TWEA) : 0);
 }
 
+static void twi_release_bus() {
+  TWCR = (1 << TWEN) | (1 << TWIE) | twi_slave_enable() | (1 << TWINT);
+  twi_state = TWI_STATE_READY;
+}
+
+/* Bus recovery ---------------------------------------------------------------
+ * With the TWI module disabled, SDA and SCL are driven directly. A line is
+ * pulled low by making it an output, and released by making it an input with
+ * the pull-up enabled, so the bus is never driven high.
+ */
+
+static void twi_line_low(uint8_t pin) {
+  PORTC &= ~(1 << pin);
+  DDRC |= (1 << pin);
+  _delay_us(TWI_RECOVERY_HALF_PERIOD_US);
+}
+
+static void twi_line_release(uint8_t pin) {
+  DDRC &= ~(1 << pin);
+  PORTC |= (1 << pin);
+  _delay_us(TWI_RECOVERY_HALF_PERIOD_US);
+}
+
+/* Reset the TWI module, which releases SDA and SCL without doing anything on
+   the bus. */
+static void twi_reset() {
+  TWCR = 0;
+  TWCR = (1 << TWEN) | (1 << TWIE) | twi_slave_enable();
+  twi_state = TWI_STATE_READY;
+  twi_timeout_ticks = 0;
+}
+
+/* A slave that was interrupted in the middle of sending a byte keeps SDA low
+   until it has clocked out the rest of it, which takes at most 9 pulses.
+   After that the stop condition resets every slave on the bus. */
+static void twi_recover_lines() {
+  uint8_t i;
+
+  TWCR = 0;
+  twi_line_release(PORTC4);
+  twi_line_release(PORTC5);
+
+  for (i = 0; i < TWI_RECOVERY_CLOCKS && !(PINC & (1 << PINC4)); i++) {
+    twi_line_low(PORTC5);
+    twi_line_release(PORTC5);
+  }
+
+  twi_line_low(PORTC5);
+  twi_line_low(PORTC4);
+  twi_line_release(PORTC5);
+  twi_line_release(PORTC4);
+
+  twi_reset();
+}
+
+/* Check whether the stop condition being sent is done, in which case the bus
+   is ready again. */
+static bool twi_stopped() {
+  if (TWCR & (1 << TWSTO)) return false;
+
+  twi_state = TWI_STATE_READY;
+  return true;
+}
+
 static void twi_stop() {
+  uint8_t polls = 0;
+
   TWCR =
     (1 << TWSTO)
     | (1 << TWEN)
     | (1 << TWIE)
-    | (1 << TWEA)
+    | twi_slave_enable()
     | (1 << TWINT);
+  twi_state = TWI_STATE_STOPPING;
 
-  /* After the stop condition is sent, the interrupt is not signalled. */
-  while (TWCR & (1 << TWSTO));
+  /* After the stop condition is sent, the interrupt is not signalled, so it
+     is polled for. Without a timeout, nothing else would finish it. */
+  while (!twi_stopped()) {
+    if (TWI_TIMEOUT_MS > 0 && ++polls == TWI_STOP_POLLS) break;
+  }
+}
 
-  twi_state = TWI_STATE_READY;
+/* Master transactions -------------------------------------------------------
+ * The next queued transaction is started whenever the bus is released.
+ */
+
+static void twi_apply_bit_rate(twi_bit_rate bit_rate) {
+  uint8_t prescaler =
+    (bit_rate >> TWI_BIT_RATE_PRESCALER_SHIFT) & TWI_BIT_RATE_MAX_PRESCALER;
+
+  TWSR = (TWSR & ~((1 << TWPS0) | (1 << TWPS1))) | prescaler;
+  TWBR = bit_rate & TWI_BIT_RATE_TWBR_MASK;
 }
 
-static void twi_release_bus() {
-  TWCR = (1 << TWEN) | (1 << TWIE) | (1 << TWEA) | (1 << TWINT);
-  twi_state = TWI_STATE_READY;
+#if TWI_MASTER
+
+static const struct twi_segment *twi_master_segment() {
+  return twi_master_segments + twi_master_segment_index;
+}
+
+static void twi_master_start_segment() {
+  const struct twi_segment *segment = twi_master_segment();
+
+  twi_master_data = segment->data;
+  twi_master_segment_left = segment->length;
+  twi_state = segment->direction == TWI_DIRECTION_READ
+    ? TWI_STATE_MASTER_RECEIVING
+    : TWI_STATE_MASTER_TRANSMITTING;
+}
+
+static void twi_master_receive(uint8_t byte) {
+  *twi_master_data++ = byte;
+  twi_master_segment_left--;
+  twi_master_received++;
+}
+
+static void twi_start_transaction(struct twi_transaction *transaction) {
+  transaction->state = TWI_TRANSACTION_STATE_ACTIVE;
+  if (transaction->bit_rate) twi_apply_bit_rate(transaction->bit_rate);
+
+  twi_master_segments = transaction->segments;
+  twi_master_segment_count = transaction->segment_count;
+  twi_master_segment_index = 0;
+  twi_master_received = 0;
+
+  twi_master_start_segment();
+  twi_send_start();
+}
+
+static void twi_start_queued() {
+  if (twi_state == TWI_STATE_READY && twi_queue_count > 0) {
+    twi_start_transaction(twi_queue[twi_queue_head]);
+  }
+}
+
+/* Finish the transaction in progress. The bus should already have been dealt
+   with. */
+static void twi_master_complete(enum twi_error error) {
+  struct twi_transaction *transaction = twi_queue[twi_queue_head];
+
+  transaction->error = error;
+  transaction->received = twi_master_received;
+  transaction->state = TWI_TRANSACTION_STATE_DONE;
+
+  twi_queue_head = (twi_queue_head + 1) % TWI_QUEUE_SIZE;
+  twi_queue_count--;
+  twi_start_queued();
+
+  /* The callback is called last, so it can submit a new transaction. */
+  if (transaction->callback) transaction->callback(transaction);
+}
+
+static void twi_master_finish(enum twi_error error) {
+  twi_stop();
+  twi_master_complete(error);
+}
+
+/* Continue with a repeated start if there are segments left, and end the
+   transaction otherwise. */
+static void twi_master_end_segment() {
+  if (++twi_master_segment_index < twi_master_segment_count) {
+    twi_master_start_segment();
+    twi_send_start();
+  } else {
+    twi_master_finish(TWI_ERROR_NONE);
+  }
+}
+
+static bool twi_master_active() {
+  return twi_state == TWI_STATE_MASTER_TRANSMITTING
+    || twi_state == TWI_STATE_MASTER_RECEIVING;
 }
 
+#else
+
+static void twi_start_queued() {}
+static void twi_master_complete(enum twi_error error) { (void)error; }
+static void twi_master_finish(enum twi_error error) { (void)error; }
+static bool twi_master_active() { return false; }
+
+#endif
+
+/* Recover the bus, failing the master transaction in progress, if any.
+   Interrupts have to be disabled. */
+static void twi_timeout() {
+  bool master = twi_master_active();
+
+  /* As a slave, the bus is driven by another master, so it is left alone. */
+  if (twi_state == TWI_STATE_SLAVE_TRANSMITTING
+      || twi_state == TWI_STATE_SLAVE_RECEIVING) {
+    twi_reset();
+  } else {
+    twi_recover_lines();
+  }
+
+  if (master) {
+    twi_master_complete(TWI_ERROR_TIMEOUT);
+  } else {
+    twi_start_queued();
+  }
+}
+
+#if TWI_TIMEOUT_MS > 0
+ISR(WDT_vect) {
+  if (twi_state == TWI_STATE_STOPPING && twi_stopped()) twi_start_queued();
+
+  if (twi_state == TWI_STATE_READY) {
+    twi_timeout_ticks = 0;
+  } else if (++twi_timeout_ticks >= TWI_TIMEOUT_TICKS) {
+    twi_timeout();
+  }
+}
+#endif
+
+#if TWI_SLAVE
+
+/* Deliver the message that was just received, and release the bus. A
+   message passed to the callback never takes a place in the queue, so
+   messages already queued are left alone. */
+static void twi_slave_receive_end() {
+  if (twi_register_map) {
+    twi_release_bus();
+  } else if (twi_slave_receive_callback) {
+    twi_release_bus();
+    twi_slave_receive_callback(twi_slave_receive_buffer,
+                               twi_slave_receive_buffer_next_index);
+  } else {
+    twi_slave_receive_buffer_commit();
+    twi_release_bus();
+  }
+  twi_start_queued();
+}
+
+#endif
+
 ISR(TWI_vect) {
+  twi_timeout_ticks = 0;
+
   switch (TW_STATUS) {
+#if TWI_MASTER
   case TW_START:
   case TW_REP_START:
-    TWDR = twi_slave_addressing_byte;
+    TWDR = (twi_master_segment()->address << 1)
+      | (twi_master_segment()->direction == TWI_DIRECTION_READ
+         ? TW_READ : TW_WRITE);
     twi_continue(true);
     break;
 
   case TW_MT_SLA_ACK:
   case TW_MT_DATA_ACK:
-    if (twi_master_buffer_data_left()) {
-      TWDR = twi_master_buffer_read();
+    if (twi_master_segment_left > 0) {
+      TWDR = *twi_master_data++;
+      twi_master_segment_left--;
       twi_continue(true);
     } else {
-      twi_stop();
+      twi_master_end_segment();
     }
     break;
 
   case TW_MT_SLA_NACK:
-    twi_error = TWI_ERROR_MASTER_START_REJECTED;
-    twi_stop();
+  case TW_MR_SLA_NACK:
+    twi_master_finish(TWI_ERROR_MASTER_START_REJECTED);
     break;
 
   case TW_MT_DATA_NACK:
-    twi_error = TWI_ERROR_MASTER_DATA_REJECTED;
-    twi_stop();
+    twi_master_finish(TWI_ERROR_MASTER_DATA_REJECTED);
     break;
 
   case TW_MT_ARB_LOST:
-    twi_error = TWI_ERROR_MASTER_ARBITRATION_LOST;
     twi_release_bus();
+    twi_master_complete(TWI_ERROR_MASTER_ARBITRATION_LOST);
     break;
 
+  /* When a byte is received, before the interrupt is signalled, the setting
+     of TWEA is transmitted in response. Because of that, it needs to be set
+     to the correct value *before* the last byte is received. */
   case TW_MR_DATA_ACK:
-    twi_master_buffer_write(TWDR);
+    twi_master_receive(TWDR);
     /* Fall through */
   case TW_MR_SLA_ACK:
-    twi_continue(twi_master_buffer_data_left());
+    twi_continue(twi_master_segment_left > 1);
     break;
 
   case TW_MR_DATA_NACK:
-    twi_master_buffer_write(TWDR);
-    twi_stop();
+    twi_master_receive(TWDR);
+    twi_master_end_segment();
     break;
+#endif
 
-  case TW_MR_SLA_NACK:
-    twi_stop();
-    break;
-
-  case TW_SR_SLA_ACK:
-  case TW_SR_GCALL_ACK:
+#if TWI_SLAVE
   case TW_SR_ARB_LOST_SLA_ACK:
   case TW_SR_ARB_LOST_GCALL_ACK:
+    if (twi_master_active()) {
+      twi_state = TWI_STATE_SLAVE_RECEIVING;
+      twi_master_complete(TWI_ERROR_MASTER_ARBITRATION_LOST);
+    }
+    /* Fall through */
+  case TW_SR_SLA_ACK:
+  case TW_SR_GCALL_ACK:
     twi_state = TWI_STATE_SLAVE_RECEIVING;
+    twi_register_map_pointer_written = false;
     twi_slave_receive_buffer_start_writing();
     twi_continue(true);
     break;
 
   case TW_SR_DATA_ACK:
   case TW_SR_GCALL_DATA_ACK:
-    if (twi_slave_receive_buffer_space_left()) {
+    if (twi_register_map) {
+      twi_continue(twi_register_map_receive(TWDR));
+    } else if (twi_slave_receive_buffer_space_left()) {
       twi_slave_receive_buffer_write(TWDR);
-      twi_continue(true);
+      /* A byte that does not fit is not acknowledged. */
+      twi_continue(twi_slave_receive_buffer_space_left());
     } else {
       twi_continue(false);
     }
     break;
   case TW_SR_STOP:
-    twi_release_bus();
-    if (twi_slave_receive_callback) {
-      twi_slave_receive_callback(twi_slave_receive_buffer,
-                                 twi_slave_receive_buffer_data_written());
-    }
+    twi_slave_receive_end();
     break;
   case TW_SR_DATA_NACK:
   case TW_SR_GCALL_DATA_NACK:
-    twi_continue(0);
+    /* The master wrote more than fits, and no stop condition is signalled
+       after a byte that was not acknowledged. The message is delivered
+       without the bytes that did not fit. */
+    if (!twi_register_map && twi_slave_truncated < 0xFF) {
+      twi_slave_truncated++;
+    }
+    twi_slave_receive_end();
     break;
 
-  case TW_ST_SLA_ACK:
   case TW_ST_ARB_LOST_SLA_ACK:
+    if (twi_master_active()) {
+      twi_state = TWI_STATE_SLAVE_TRANSMITTING;
+      twi_master_complete(TWI_ERROR_MASTER_ARBITRATION_LOST);
+    }
+    /* Fall through */
+  case TW_ST_SLA_ACK:
     twi_state = TWI_STATE_SLAVE_TRANSMITTING;
 
+    if (twi_register_map) {
+      TWDR = twi_register_map_transmit();
+      twi_continue(true);
+      break;
+    }
+
     if (twi_slave_transmit_callback) twi_slave_transmit_callback();
 
     if (twi_slave_transmit_buffer_data_written() == 0) {
@@ -240,19 +603,32 @@ ISR(TWI_vect) {
     twi_slave_transmit_buffer_start_reading();
     /* Fall through */
   case TW_ST_DATA_ACK:
+    if (twi_register_map) {
+      TWDR = twi_register_map_transmit();
+      twi_continue(true);
+      break;
+    }
+
     TWDR = twi_slave_transmit_buffer_read();
     twi_continue(twi_slave_transmit_buffer_data_left());
     break;
   case TW_ST_DATA_NACK:
   case TW_ST_LAST_DATA:
-    twi_continue(true);
+    twi_continue(twi_slave_accepting);
     twi_state = TWI_STATE_READY;
+    twi_start_queued();
     break;
+#endif
+
   case TW_NO_INFO:
     break;
   case TW_BUS_ERROR:
-    twi_error = TWI_ERROR_BUS;
-    twi_stop();
+    if (twi_master_active()) {
+      twi_master_finish(TWI_ERROR_BUS);
+    } else {
+      twi_stop();
+      twi_start_queued();
+    }
     break;
   }
 }
@@ -261,92 +637,230 @@ ISR(TWI_vect) {
 
 void twi_init() {
   twi_state = TWI_STATE_READY;
+#if TWI_MASTER
+  twi_queue_head = twi_queue_count = 0;
+#endif
+#if TWI_SLAVE
+  twi_slave_receive_head = twi_slave_receive_count = 0;
+  twi_slave_accepting = true;
+  twi_slave_truncated = 0;
+#endif
+
+  twi_set_frequency(TWI_FREQUENCY);
+
+  /* This sets up SDA and SCL, in case a slave was left holding the bus by a
+     reset. */
+  twi_recover_lines();
+
+#if TWI_TIMEOUT_MS > 0
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    wdt_reset();
+    WDTCSR = (1 << WDCE) | (1 << WDE);
+    WDTCSR = (1 << WDIE);
+  }
+#endif
+}
+
+twi_bit_rate twi_compute_bit_rate(uint32_t frequency) {
+  uint32_t cycles, divisor, twbr;
+  uint8_t prescaler;
 
-  /* SDA */
-  DDRC &= ~(1 << PORTC4);
-  PORTC |= (1 << PORTC4);
-  /* SCL */
-  DDRC &= ~(1 << PORTC5);
-  PORTC |= (1 << PORTC5);
+  if (frequency == 0) return TWI_BIT_RATE_SLOWEST;
 
-  /* We always use a prescaler value of 1. */
-  TWSR &= ~((1 << TWPS0) | (1 << TWPS1));
-  TWBR = ((F_CPU / TWI_FREQUENCY) - 16) / 2;
+  /* Rounding the cycle count up keeps the frequency at or below the one
+     requested. */
+  cycles = (F_CPU + frequency - 1) / frequency;
+  if (cycles <= TWI_BIT_RATE_BASE_CYCLES) return TWI_BIT_RATE_SET_FLAG;
+  cycles -= TWI_BIT_RATE_BASE_CYCLES;
+
+  for (prescaler = 0; prescaler <= TWI_BIT_RATE_MAX_PRESCALER; prescaler++) {
+    divisor = 2UL << (2 * prescaler);
+    twbr = (cycles + divisor - 1) / divisor;
+    if (twbr <= TWI_BIT_RATE_TWBR_MASK) {
+      return TWI_BIT_RATE_SET_FLAG
+        | (prescaler << TWI_BIT_RATE_PRESCALER_SHIFT) | twbr;
+    }
+  }
 
-  TWCR = (1 << TWEA) | (1 << TWEN) | (1 << TWIE);
+  return TWI_BIT_RATE_SLOWEST;
 }
 
+void twi_set_bit_rate(twi_bit_rate bit_rate) {
+#if TWI_MASTER
+  twi_wait();
+#endif
+  twi_apply_bit_rate(bit_rate);
+}
+
+uint32_t twi_set_frequency(uint32_t frequency) {
+  twi_bit_rate bit_rate = twi_compute_bit_rate(frequency);
+  uint8_t prescaler =
+    (bit_rate >> TWI_BIT_RATE_PRESCALER_SHIFT) & TWI_BIT_RATE_MAX_PRESCALER;
+  uint32_t twbr = bit_rate & TWI_BIT_RATE_TWBR_MASK;
+
+  twi_set_bit_rate(bit_rate);
+  return F_CPU
+    / (TWI_BIT_RATE_BASE_CYCLES + ((2 * twbr) << (2 * prescaler)));
+}
+
+void twi_recover_bus() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    twi_timeout();
+  }
+}
+
+#if TWI_SLAVE
+
 void twi_set_address(uint8_t address, bool recognize_general_call) {
   TWAR = (address << 1) | recognize_general_call;
 }
 
-bool twi_write(uint8_t address,
-               uint8_t *data,
-               uint8_t size,
-               enum twi_error *error) {
-  uint8_t i;
+uint8_t *twi_slave_receive(uint8_t *size) {
+  if (twi_slave_receive_count == 0) return NULL;
 
-  if (size > TWI_BUFFER_SIZE) return false;
-  while (twi_state != TWI_STATE_READY);
+  *size = twi_slave_receive_sizes[twi_slave_receive_head];
+  /* The interrupt leaves the buffer alone until it is released. */
+  return (uint8_t *)twi_slave_receive_buffers[twi_slave_receive_head];
+}
 
-  twi_state = TWI_STATE_MASTER_TRANSMITTING;
-  twi_error = TWI_ERROR_NONE;
+void twi_slave_release() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (twi_slave_receive_count == 0) return;
 
-  twi_slave_addressing_byte = (address << 1) | TW_WRITE;
+    twi_slave_receive_buffer_release();
+  }
+}
 
-  twi_master_buffer_start_writing(size);
-  for (i = 0; i < size; i++) {
-    twi_master_buffer_write(data[i]);
+uint8_t twi_slave_truncated_count() {
+  uint8_t count;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = twi_slave_truncated;
+    twi_slave_truncated = 0;
+  }
+  return count;
+}
+
+void twi_set_register_map(volatile uint8_t *registers, uint8_t size) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    twi_register_map = registers;
+    twi_register_map_size = size;
+    twi_register_map_pointer = 0;
   }
+}
 
-  twi_master_buffer_start_reading();
+#endif
 
-  twi_send_start();
+#if TWI_MASTER
 
-  while (twi_state == TWI_STATE_MASTER_TRANSMITTING);
+static bool twi_master_valid(const struct twi_segment *segments,
+                             uint8_t count) {
+  uint8_t i;
 
-  *error = twi_error;
-  return true;
+  for (i = 0; i < count; i++) {
+    if (segments[i].direction == TWI_DIRECTION_READ
+        && segments[i].length == 0) {
+      return false;
+    }
+  }
+
+  return count > 0;
 }
 
-uint8_t twi_read(uint8_t address,
-                 uint8_t *data,
-                 uint8_t size,
-                 enum twi_error *error) {
-  uint8_t i;
+/* Run a transaction made of segments that are known to be valid, and wait
+   for it. Returns the number of bytes read. */
+static uint16_t twi_run(const struct twi_segment *segments,
+                        uint8_t count,
+                        enum twi_error *error) {
+  struct twi_transaction transaction;
 
-  if (size > TWI_BUFFER_SIZE) return 0;
-  while (twi_state != TWI_STATE_READY);
+  transaction.segments = segments;
+  transaction.segment_count = count;
+  transaction.bit_rate = 0;
+  transaction.callback = NULL;
 
-  twi_state = TWI_STATE_MASTER_RECEIVING;
-  twi_error = TWI_ERROR_NONE;
+  while (!twi_submit(&transaction));
+  while (transaction.state != TWI_TRANSACTION_STATE_DONE);
 
-  twi_slave_addressing_byte = (address << 1) | TW_READ;
+  *error = transaction.error;
+  return transaction.received;
+}
 
-  /* When a byte is received, before the interrupt is signalled, the setting of
-     TWEA is transmitted in response. Because of that, it needs to be set to
-     the correct value *before* the last byte is received. That's why we
-     subtract 1 from the expected size. */
-  twi_master_buffer_start_writing(size - 1);
+bool twi_write(uint8_t address,
+               uint8_t *data,
+               uint16_t size,
+               enum twi_error *error) {
+  struct twi_segment segment = {address, TWI_DIRECTION_WRITE, data, size};
 
-  twi_send_start();
+  twi_run(&segment, 1, error);
+  return true;
+}
+
+uint16_t twi_read(uint8_t address,
+                  uint8_t *data,
+                  uint16_t size,
+                  enum twi_error *error) {
+  struct twi_segment segment = {address, TWI_DIRECTION_READ, data, size};
+
+  if (!twi_master_valid(&segment, 1)) return 0;
+
+  return twi_run(&segment, 1, error);
+}
+
+bool twi_write_read(uint8_t address,
+                    uint8_t *tx_data,
+                    uint16_t tx_length,
+                    uint8_t *rx_data,
+                    uint16_t rx_length,
+                    enum twi_error *error) {
+  struct twi_segment segments[2] = {
+    {address, TWI_DIRECTION_WRITE, tx_data, tx_length},
+    {address, TWI_DIRECTION_READ, rx_data, rx_length}
+  };
+
+  return twi_transfer(segments, 2, error);
+}
 
-  while (twi_state == TWI_STATE_MASTER_RECEIVING);
+bool twi_transfer(const struct twi_segment *segments,
+                  uint8_t count,
+                  enum twi_error *error) {
+  if (!twi_master_valid(segments, count)) return false;
 
-  if (twi_master_buffer_data_written() < size) {
-    /* Less data was received than was requested */
-    size = twi_master_buffer_data_written();
+  twi_run(segments, count, error);
+  return true;
+}
+
+bool twi_submit(struct twi_transaction *transaction) {
+  if (!twi_master_valid(transaction->segments, transaction->segment_count)) {
+    return false;
   }
 
-  twi_master_buffer_start_reading();
-  for (i = 0; i < size; i++) {
-    data[i] = twi_master_buffer_read();
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (twi_queue_count == TWI_QUEUE_SIZE) return false;
+
+    transaction->state = TWI_TRANSACTION_STATE_QUEUED;
+    twi_queue[(twi_queue_head + twi_queue_count) % TWI_QUEUE_SIZE]
+      = transaction;
+    twi_queue_count++;
+
+    twi_start_queued();
   }
 
-  *error = twi_error;
-  return size;
+  return true;
+}
+
+bool twi_busy() {
+  return twi_queue_count > 0;
+}
+
+void twi_wait() {
+  while (twi_busy());
 }
 
+#endif
+
+#if TWI_SLAVE
+
 bool twi_transmit_reply(uint8_t *data, uint8_t size) {
   uint8_t i;
   if (size > TWI_BUFFER_SIZE) return false;
@@ -359,3 +873,5 @@ bool twi_transmit_reply(uint8_t *data, uint8_t size) {
 
   return true;
 }
+
+#endif
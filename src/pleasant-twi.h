@@ -4,8 +4,8 @@
  * easy to use.
  *
  * The TWI module can operate both as a master and a slave, and both operating
- * modes are supported by Pleasant TWI. It does not have support for repeated
- * starts.
+ * modes are supported by Pleasant TWI. As a master, several segments can be
+ * combined into a single transaction using repeated starts.
  *
  * Note that unlike the rest of Pleasant Uno AVR, Pleasant TWI is released
  * under the GNU Lesser General Public License as published by the Free
@@ -20,11 +20,77 @@
 #include <stdint.h>
 
 /* Settings -------------------------------------------------------------------
- * These settings don't normally have to change.
+ * These settings don't normally have to change. TWI_FREQUENCY is the SCL
+ * frequency set up by twi_init. TWI_BUFFER_SIZE is the size of the slave
+ * buffers; master transfers use the caller's buffers directly.
  */
 
-#define TWI_FREQUENCY           100000
-#define TWI_BUFFER_SIZE         32
+#define TWI_FREQUENCY                100000
+#define TWI_BUFFER_SIZE              32
+#define TWI_SLAVE_RECEIVE_QUEUE_SIZE 2
+
+/* Operating modes ------------------------------------------------------------
+ * Firmware that only uses one of the operating modes can define TWI_MASTER or
+ * TWI_SLAVE as 0 when building Pleasant TWI. The functions, buffers and
+ * interrupt handling of that mode are then left out. A master-only build does
+ * not acknowledge any slave address.
+ */
+
+#ifndef TWI_MASTER
+#define TWI_MASTER 1
+#endif
+
+#ifndef TWI_SLAVE
+#define TWI_SLAVE 1
+#endif
+
+/* Timeouts -------------------------------------------------------------------
+ * A slave holding SDA or SCL low keeps the bus, and every function waiting for
+ * it, busy forever. To prevent that, firmware that does not use the watchdog
+ * timer itself can define TWI_TIMEOUT_MS as 32 or more when building Pleasant
+ * TWI. twi_init then takes over the watchdog timer, in interrupt mode, which
+ * fires about every 16 ms.
+ *
+ * When the bus is in use and the TWI interrupt has not been signalled for
+ * TWI_TIMEOUT_MS, rounded down to a multiple of 16 ms, the bus is recovered
+ * by clocking out up to 9 SCL pulses, until SDA is released, and sending a
+ * stop condition. A master transaction in progress then fails with
+ * TWI_ERROR_TIMEOUT. While this device is being addressed as a slave, the bus
+ * is driven by another master, so only the TWI module is reset.
+ *
+ * Because the watchdog timer runs independently, the timeout can expire up to
+ * 16 ms early. Every byte on the bus takes at most TWI_TIMEOUT_MS, and the
+ * timeout has to be at least 16 ms longer than any clock stretching by
+ * slaves, and any use of the bus by other masters. The watchdog oscillator is
+ * not very accurate, so these times are approximate.
+ *
+ * With timeouts enabled, a stop condition that takes longer than about 128
+ * us, at SCL frequencies below about 10 kHz, is finished by the watchdog
+ * interrupt instead of the TWI interrupt waiting for it.
+ */
+
+#ifndef TWI_TIMEOUT_MS
+#define TWI_TIMEOUT_MS 0
+#endif
+
+/* Bit rate -------------------------------------------------------------------
+ * The SCL frequency is F_CPU / (16 + 2 * TWBR * 4^prescaler). A twi_bit_rate
+ * holds both the TWBR value and the prescaler, so it can be computed once for
+ * each device and switched to cheaply before each transaction. Devices on the
+ * same bus can then run at different speeds.
+ *
+ * At 16 MHz the highest frequency is 1 MHz, with a TWBR of 0. Fast mode and
+ * faster usually need stronger external pull-ups than the internal ones.
+ */
+
+typedef uint16_t twi_bit_rate;
+
+/* Set in every computed bit rate, so that 0 can stand for "unchanged". */
+#define TWI_BIT_RATE_SET_FLAG 0x8000
+
+#define TWI_FREQUENCY_STANDARD_MODE  100000
+#define TWI_FREQUENCY_FAST_MODE      400000
+#define TWI_FREQUENCY_FAST_MODE_PLUS 1000000
 
 /* State ----------------------------------------------------------------------
  * The state of the TWI module is changed based on the operation currently
@@ -35,7 +101,8 @@ enum twi_state {
   TWI_STATE_MASTER_TRANSMITTING,
   TWI_STATE_MASTER_RECEIVING,
   TWI_STATE_SLAVE_TRANSMITTING,
-  TWI_STATE_SLAVE_RECEIVING
+  TWI_STATE_SLAVE_RECEIVING,
+  TWI_STATE_STOPPING
 };
 
 /* Error ----------------------------------------------------------------------
@@ -46,7 +113,63 @@ enum twi_error {
   TWI_ERROR_MASTER_START_REJECTED,
   TWI_ERROR_MASTER_DATA_REJECTED,
   TWI_ERROR_MASTER_ARBITRATION_LOST,
-  TWI_ERROR_BUS
+  TWI_ERROR_BUS,
+  TWI_ERROR_TIMEOUT
+};
+
+/* Segments -------------------------------------------------------------------
+ * A master transaction consists of one or more segments, each of which either
+ * writes data to or reads data from a slave. Segments are separated by
+ * repeated starts, so the bus is not released in between. This is commonly
+ * used to write a register address, and then read the register's value.
+ *
+ * The interrupt reads and writes the data buffers directly, so segments can be
+ * up to 65535 bytes long. Read segments have to read at least one byte.
+ */
+enum twi_direction {
+  TWI_DIRECTION_WRITE = 0,
+  TWI_DIRECTION_READ  = 1
+};
+
+struct twi_segment {
+  uint8_t address;
+  enum twi_direction direction;
+  uint8_t *data;
+  uint16_t length;
+};
+
+/* Asynchronous transactions --------------------------------------------------
+ * A transaction describes a complete master transaction, made up of
+ * segment_count segments. If bit_rate is not 0, it is switched to before the
+ * transaction starts. If callback is not NULL, it is called after the
+ * transaction has completed. It is called from inside the TWI interrupt, so it
+ * must not use the synchronous master functions.
+ *
+ * When a transaction is done, error holds its result, and received the number
+ * of bytes read by its read segments.
+ *
+ * The transaction, its segments, and the buffers they point to are used
+ * directly by the interrupt and must stay valid until the transaction is
+ * done.
+ */
+
+#define TWI_QUEUE_SIZE 4
+
+enum twi_transaction_state {
+  TWI_TRANSACTION_STATE_IDLE,
+  TWI_TRANSACTION_STATE_QUEUED,
+  TWI_TRANSACTION_STATE_ACTIVE,
+  TWI_TRANSACTION_STATE_DONE
+};
+
+struct twi_transaction {
+  const struct twi_segment *segments;
+  uint8_t segment_count;
+  twi_bit_rate bit_rate;
+  void (*callback)(struct twi_transaction *transaction);
+  volatile enum twi_transaction_state state;
+  volatile enum twi_error error;
+  volatile uint16_t received;
 };
 
 /* General operation ------------------------------------------------------- */
@@ -58,43 +181,158 @@ enum twi_error {
  */
 void twi_init();
 
+/*
+ * Compute the bit rate setting for an SCL frequency. The frequency is rounded
+ * down to the nearest one that can be generated, so it is never exceeded,
+ * unless it is higher than the highest possible frequency. A frequency below
+ * the lowest possible one, including 0, gives the lowest one.
+ */
+twi_bit_rate twi_compute_bit_rate(uint32_t frequency);
+
+/*
+ * Switch to a bit rate computed by twi_compute_bit_rate. If transactions are
+ * queued, this waits until they have finished.
+ */
+void twi_set_bit_rate(twi_bit_rate bit_rate);
+
+/*
+ * Compute and switch to the bit rate for an SCL frequency. Returns the actual
+ * frequency used.
+ */
+uint32_t twi_set_frequency(uint32_t frequency);
+
+/*
+ * Free the bus by clocking out up to 9 SCL pulses, until SDA is released, and
+ * sending a stop condition. A master transaction in progress fails with
+ * TWI_ERROR_TIMEOUT. While this device is being addressed as a slave, only
+ * the TWI module is reset. This is done automatically after a timeout, and by
+ * twi_init.
+ */
+void twi_recover_bus();
+
 /* Master operation -------------------------------------------------------- */
 
+#if TWI_MASTER
+
 /*
  * Read data from a slave. Data is written into the data buffer, up to the
- * specified length. The length of data read is returned, in case the slave
- * returns less than requested. If the data requested would not fit into the
- * internal buffer, 0 will be returned and no TWI operations will be performed.
+ * specified length. The length of data read is returned, which is less than
+ * requested if an error occurs. If the length is 0, 0 will be returned and no
+ * TWI operations will be performed.
  */
-uint8_t twi_read(uint8_t address,
-                 uint8_t *data,
-                 uint8_t length,
-                 enum twi_error *error);
+uint16_t twi_read(uint8_t address,
+                  uint8_t *data,
+                  uint16_t length,
+                  enum twi_error *error);
 
 /*
- * Write data to a slave. If the data sent does not fit into the internal
- * buffer, false will be returned. Otherwise the return value will be true, and
- * an error will be indicated through the error pointer.
+ * Write data to a slave. The return value will be true, and an error will be
+ * indicated through the error pointer.
  */
 bool twi_write(uint8_t address,
                uint8_t *data,
-               uint8_t length,
+               uint16_t length,
                enum twi_error *error);
 
+/*
+ * Write data to a slave, and then read data from it after a repeated start.
+ * Like twi_transfer, false will be returned if rx_length is 0.
+ */
+bool twi_write_read(uint8_t address,
+                    uint8_t *tx_data,
+                    uint16_t tx_length,
+                    uint8_t *rx_data,
+                    uint16_t rx_length,
+                    enum twi_error *error);
+
+/*
+ * Perform a transaction consisting of count segments. If there are no
+ * segments, or a read segment has a length of 0, false will be returned and
+ * no TWI operations will be performed. Otherwise the return value will be
+ * true, and an error will be indicated through the error pointer. The
+ * transaction ends at the first error, in which case later read segments are
+ * left untouched.
+ */
+bool twi_transfer(const struct twi_segment *segments,
+                  uint8_t count,
+                  enum twi_error *error);
+
+/*
+ * Queue a transaction, and return immediately. If the queue is full, or the
+ * transaction would not be accepted by twi_transfer, false is returned and the
+ * transaction is not queued.
+ *
+ * The state of the transaction is updated as it progresses, so completion can
+ * be polled for instead of using a callback.
+ */
+bool twi_submit(struct twi_transaction *transaction);
+
+/*
+ * Check whether any transactions are queued or in progress.
+ */
+bool twi_busy();
+
+/*
+ * Wait until all queued transactions have completed.
+ */
+void twi_wait();
+
+#endif
+
 /* Slave operation --------------------------------------------------------- */
 
+#if TWI_SLAVE
+
 /*
  * Set the 7-bit address of this device. The recognize_general_call boolean
  * specifies whether or not messages on the address 0 should also be received.
  */
 void twi_set_address(uint8_t address, bool recognize_general_call);
 
+/* Receive queue --------------------------------------------------------------
+ * Messages written by masters are stored in a queue of
+ * TWI_SLAVE_RECEIVE_QUEUE_SIZE buffers, of TWI_BUFFER_SIZE bytes each, so they
+ * can be processed outside of the TWI interrupt. The interrupt only stores
+ * bytes, so its time does not depend on the application. While all buffers
+ * hold messages, the slave does not acknowledge its address, so masters see
+ * that they have to try again instead of messages being lost.
+ *
+ * If twi_slave_receive_callback is set, messages are instead passed to it as
+ * soon as they have been received, without being queued. The data is only
+ * valid until it returns.
+ *
+ * A message longer than TWI_BUFFER_SIZE bytes is cut off: the first byte that
+ * does not fit is not acknowledged, so the master stops sending, and the
+ * bytes received up to then are delivered as a message of their own. This is
+ * counted, so it can be detected using twi_slave_truncated_count.
+ */
+
 /*
- * Function called when data is received from a master.
+ * Function called from the TWI interrupt when data is received from a
+ * master. While it runs, the bus is held up.
  */
 extern void (*twi_slave_receive_callback)(volatile uint8_t *data,
                                           uint8_t size);
 
+/*
+ * Return the oldest message received from a master, storing its size in
+ * size, or return NULL if there is none. The message stays valid until it is
+ * released using twi_slave_release.
+ */
+uint8_t *twi_slave_receive(uint8_t *size);
+
+/*
+ * Release the message returned by twi_slave_receive, making its buffer
+ * available for new messages.
+ */
+void twi_slave_release();
+
+/*
+ * Return the number of received messages that were cut off since the last
+ * call, up to 255.
+ */
+uint8_t twi_slave_truncated_count();
+
 /*
  * Function called when data is requested by a master. The response should be
  * returned using twi_transmit_reply.
@@ -108,4 +346,33 @@ extern void (*twi_slave_transmit_callback)();
  */
 bool twi_transmit_reply(uint8_t *data, uint8_t size);
 
+/* Register map ---------------------------------------------------------------
+ * Instead of using the callbacks, a slave can expose a region of memory as a
+ * set of registers, as many sensors do. The first byte written by a master
+ * sets the register pointer, and any further bytes are stored in the
+ * registers starting there. Reads return the registers starting at the
+ * pointer. The pointer is incremented after every byte, and is kept between
+ * transactions, so a master can set it and read from it after a repeated
+ * start.
+ *
+ * All of this is handled by the TWI interrupt, without calling back into the
+ * application, so the slave never has to stretch the clock. Writes past the
+ * end of the region are not acknowledged, and reads past it return
+ * TWI_REGISTER_MAP_FILL_BYTE.
+ *
+ * Registers may be changed by the interrupt at any time. Values wider than a
+ * byte should be read and updated with interrupts disabled, so a master never
+ * sees half of an update.
+ */
+
+#define TWI_REGISTER_MAP_FILL_BYTE 0xFF
+
+/*
+ * Serve the size registers at registers to masters, instead of using the
+ * callbacks. Passing NULL returns to using the callbacks.
+ */
+void twi_set_register_map(volatile uint8_t *registers, uint8_t size);
+
+#endif
+
 #endif /* PLEASANT_TWI_H */
@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include "pleasant-usart-spi.h"
+
+bool usart_spi_configured = false;
+
+static void usart_spi_ensure_configured() {
+  if (!usart_spi_configured) {
+    usart_spi_configure(USART_SPI_DEFAULT_CLOCK_DIVISOR,
+                        USART_SPI_DEFAULT_MODE,
+                        USART_SPI_DEFAULT_BIT_ORDER);
+  }
+}
+
+static void usart_spi_wait_transmit_buffer() {
+  while (!(UCSR0A & (1 << UDRE0)));
+}
+
+static void usart_spi_wait_receive() {
+  while (!(UCSR0A & (1 << RXC0)));
+}
+
+/* API functions ----------------------------------------------------------- */
+
+void usart_spi_configure(uint16_t clock_divisor,
+                         enum usart_spi_mode mode,
+                         enum usart_spi_bit_order bit_order) {
+  /* The baud rate register has to be zero while the transmitter is being
+     enabled. */
+  UBRR0 = 0;
+
+  DDRD |= (1 << PORTD4);          /* XCK: used as SCK */
+
+  UCSR0C = (1 << UMSEL01) | (1 << UMSEL00) | mode | bit_order;
+  UCSR0B = (1 << TXEN0) | (1 << RXEN0);
+
+  UBRR0 = (clock_divisor / 2) - 1;
+
+  usart_spi_configured = true;
+}
+
+uint8_t usart_spi_transfer(uint8_t data) {
+  usart_spi_ensure_configured();
+
+  usart_spi_wait_transmit_buffer();
+  UDR0 = data;
+  usart_spi_wait_receive();
+  return UDR0;
+}
+
+/* The transmitter is double buffered, so the next byte is loaded while the
+   previous one is still being shifted out. At most two bytes are in flight,
+   which is as much as the receive buffer can hold. */
+
+void usart_spi_transfer_bytes(uint8_t *bytes, size_t count) {
+  size_t i;
+
+  if (count == 0) return;
+  usart_spi_ensure_configured();
+
+  usart_spi_wait_transmit_buffer();
+  UDR0 = *bytes;
+
+  for (i = 0; i < count; i++) {
+    if (i + 1 < count) {
+      usart_spi_wait_transmit_buffer();
+      UDR0 = *(bytes + i + 1);
+    }
+
+    usart_spi_wait_receive();
+    *(bytes + i) = UDR0;
+  }
+}
+
+void usart_spi_write_bytes(const uint8_t *bytes, size_t count) {
+  size_t i;
+
+  if (count == 0) return;
+  usart_spi_ensure_configured();
+
+  /* TXC0 is cleared by writing a one to it. */
+  UCSR0A = (1 << TXC0);
+
+  for (i = 0; i < count; i++) {
+    usart_spi_wait_transmit_buffer();
+    UDR0 = *(bytes + i);
+  }
+
+  while (!(UCSR0A & (1 << TXC0)));
+
+  /* Discard whatever was received in the meantime. */
+  while (UCSR0A & (1 << RXC0)) (void)UDR0;
+}
+
+void usart_spi_read_bytes(uint8_t *bytes, size_t count, uint8_t fill) {
+  size_t i;
+
+  if (count == 0) return;
+  usart_spi_ensure_configured();
+
+  usart_spi_wait_transmit_buffer();
+  UDR0 = fill;
+
+  for (i = 0; i < count; i++) {
+    if (i + 1 < count) {
+      usart_spi_wait_transmit_buffer();
+      UDR0 = fill;
+    }
+
+    usart_spi_wait_receive();
+    *(bytes + i) = UDR0;
+  }
+}
@@ -0,0 +1,92 @@
+/*
+ * Pleasant USART SPI allows you to use the device's USART module as a second
+ * SPI master, using its Master SPI Mode (MSPIM). Unlike the SPI module, the
+ * USART has a buffered transmitter, so bytes can be sent back to back without
+ * any gap between them. It offers the same transfer functions as Pleasant SPI.
+ *
+ * The pins D4 (XCK, used as SCK), D1 (TXD, used as MOSI) and D0 (RXD, used as
+ * MISO) are used. There is no slave select pin, so chip select pins have to be
+ * controlled separately.
+ *
+ * Because it uses the same hardware, Pleasant USART SPI can not be used at the
+ * same time as Pleasant USART.
+ */
+
+#ifndef PLEASANT_USART_SPI_H
+#define PLEASANT_USART_SPI_H
+
+#include <avr/io.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bit order --------------------------------------------------------------- */
+
+enum usart_spi_bit_order {
+  USART_SPI_BIT_ORDER_MSB_FIRST = (0 << UDORD0),
+  USART_SPI_BIT_ORDER_LSB_FIRST = (1 << UDORD0)
+};
+
+/* Mode -----------------------------------------------------------------------
+ * The SPI mode determines the clock polarity and the clock edge at which data
+ * is sampled.
+ */
+
+enum usart_spi_mode {
+  USART_SPI_MODE_0 = (0 << UCPOL0) | (0 << UCPHA0),
+  USART_SPI_MODE_1 = (0 << UCPOL0) | (1 << UCPHA0),
+  USART_SPI_MODE_2 = (1 << UCPOL0) | (0 << UCPHA0),
+  USART_SPI_MODE_3 = (1 << UCPOL0) | (1 << UCPHA0)
+};
+
+/* Clock divisor --------------------------------------------------------------
+ * The SPI clock runs at F_CPU divided by the clock divisor, which has to be an
+ * even number from 2 up to and including 8192.
+ */
+
+#define USART_SPI_CLOCK_DIVISOR_MIN 2
+#define USART_SPI_CLOCK_DIVISOR_MAX 8192
+
+/* State ------------------------------------------------------------------- */
+
+#define USART_SPI_DEFAULT_CLOCK_DIVISOR 64
+#define USART_SPI_DEFAULT_MODE          USART_SPI_MODE_0
+#define USART_SPI_DEFAULT_BIT_ORDER     USART_SPI_BIT_ORDER_MSB_FIRST
+
+extern bool usart_spi_configured;
+
+/* API functions ----------------------------------------------------------- */
+
+/*
+ * Configure the USART as an SPI master and set up the ports it uses.
+ *
+ * If you don't call this function before transferring data, it will
+ * automatically be called with the USART_SPI_DEFAULT_* settings.
+ */
+void usart_spi_configure(uint16_t clock_divisor,
+                         enum usart_spi_mode mode,
+                         enum usart_spi_bit_order bit_order);
+
+/*
+ * Send a single byte, returning the received byte.
+ */
+uint8_t usart_spi_transfer(uint8_t data);
+
+/*
+ * Send and receive a number of bytes. Each byte sent will be replaced with the
+ * corresponding received byte.
+ */
+void usart_spi_transfer_bytes(uint8_t *bytes, size_t count);
+
+/*
+ * Send a number of bytes, discarding the bytes received. Returns once the last
+ * byte has been sent completely.
+ */
+void usart_spi_write_bytes(const uint8_t *bytes, size_t count);
+
+/*
+ * Receive a number of bytes, sending the fill byte for each one.
+ */
+void usart_spi_read_bytes(uint8_t *bytes, size_t count, uint8_t fill);
+
+#endif /* PLEASANT_USART_SPI_H */
@@ -1,8 +1,179 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "pleasant-timer.h"
 #include "pleasant-usart.h"
 
-void usart_init(uint32_t baud_rate,
-                enum usart_asynchronous_mode asynchronous_mode,
+/* Buffers --------------------------------------------------------------------
+ * Both buffers are ring buffers, with head being the next index to be written
+ * and tail the next index to be read. One entry is always left empty, so that
+ * a full buffer can be told apart from an empty one.
+ */
+
+#if (USART_RX_BUFFER_SIZE & (USART_RX_BUFFER_SIZE - 1)) != 0 \
+  || (USART_TX_BUFFER_SIZE & (USART_TX_BUFFER_SIZE - 1)) != 0
+#error "USART buffer sizes must be powers of two"
+#endif
+
+#if USART_FLOW_CONTROL && !USART_RECEIVER
+#error "USART flow control needs the receiver"
+#endif
+
+#define USART_RX_MASK (USART_RX_BUFFER_SIZE - 1)
+#define USART_TX_MASK (USART_TX_BUFFER_SIZE - 1)
+
+#if USART_RECEIVER
+static volatile uint8_t usart_rx_buffer[USART_RX_BUFFER_SIZE];
+static volatile uint8_t usart_rx_error_buffer[USART_RX_BUFFER_SIZE];
+static volatile uint8_t usart_rx_head;
+static volatile uint8_t usart_rx_tail;
+
+/* Set when a byte was lost because the receive buffer was full. The next
+   byte stored is then marked as a data overrun. */
+static volatile bool usart_rx_lost;
+#endif
+
+static volatile uint8_t usart_tx_buffer[USART_TX_BUFFER_SIZE];
+static volatile uint8_t usart_tx_head;
+static volatile uint8_t usart_tx_tail;
+
+/* TXC0 is only ever set after something has been sent. */
+static volatile bool usart_tx_written;
+
+#if USART_RECEIVER
+static uint8_t usart_rx_fill() {
+  return (usart_rx_head - usart_rx_tail) & USART_RX_MASK;
+}
+#endif
+
+/* Flow control ------------------------------------------------------------ */
+
+#if USART_FLOW_CONTROL
+
+#define USART_CTS_INPUT PIND
+#define USART_CTS_PIN   PIND2
+
+static bool usart_cts_deasserted() {
+  return USART_CTS_INPUT & (1 << USART_CTS_PIN);
+}
+
+static void usart_update_rts() {
+  uint8_t fill = usart_rx_fill();
+
+  if (fill >= USART_RTS_HIGH_WATERMARK) {
+    USART_RTS_PORT |= (1 << USART_RTS_PIN);
+  } else if (fill <= USART_RTS_LOW_WATERMARK) {
+    USART_RTS_PORT &= ~(1 << USART_RTS_PIN);
+  }
+}
+
+static void usart_init_flow_control() {
+  USART_RTS_DDR |= (1 << USART_RTS_PIN);
+  USART_RTS_PORT &= ~(1 << USART_RTS_PIN);
+
+  DDRD &= ~(1 << PORTD2);
+  PORTD |= (1 << PORTD2);
+
+  /* Interrupt on the falling edge of CTS. */
+  EICRA = (EICRA & ~((1 << ISC01) | (1 << ISC00))) | (1 << ISC01);
+  EIFR = (1 << INTF0);
+  EIMSK |= (1 << INT0);
+}
+
+ISR(INT0_vect) {
+  if (usart_tx_head != usart_tx_tail) UCSR0B |= (1 << UDRIE0);
+}
+
+#else
+
+#if USART_RECEIVER
+static void usart_update_rts() {}
+#endif
+static void usart_init_flow_control() {}
+
+#endif
+
+#if USART_RECEIVER
+
+/* Multi-processor communication -------------------------------------------- */
+
+static volatile bool usart_multiprocessor_enabled;
+static volatile uint8_t usart_multiprocessor_address;
+
+/* UCSR0A also holds flags that are cleared by writing a one, and read-only
+   flags that must be written as zero, so only U2X0 is preserved. */
+static void usart_set_multiprocessor_mode(bool enabled) {
+  UCSR0A = (UCSR0A & (1 << U2X0)) | (enabled ? (1 << MPCM0) : 0);
+}
+
+/* Callbacks --------------------------------------------------------------- */
+
+void (*usart_receive_callback)(uint8_t byte, enum usart_error error);
+
+ISR(USART_RX_vect) {
+  /* The status and the 9th bit have to be read before UDR0. */
+  uint8_t status = UCSR0A;
+  uint8_t ninth_bit = UCSR0B & (1 << RXB80);
+  uint8_t byte = UDR0;
+  uint8_t head, next;
+  uint8_t error =
+    (status & (1 << FE0) ? USART_ERROR_FRAME_ERROR : 0)
+    | (status & (1 << DOR0) ? USART_ERROR_DATA_OVERRUN : 0)
+    | (status & (1 << UPE0) ? USART_ERROR_PARITY_MISMATCH : 0);
+
+  if (usart_multiprocessor_enabled && ninth_bit) {
+    /* Only receive data frames when we are the one being addressed. */
+    usart_set_multiprocessor_mode(byte != usart_multiprocessor_address);
+    return;
+  }
+
+  if (usart_receive_callback) {
+    usart_receive_callback(byte, error);
+    return;
+  }
+
+  head = usart_rx_head;
+  next = (head + 1) & USART_RX_MASK;
+
+  if (next != usart_rx_tail) {
+    usart_rx_buffer[head] = byte;
+    usart_rx_error_buffer[head] =
+      error | (usart_rx_lost ? USART_ERROR_DATA_OVERRUN : 0);
+    usart_rx_head = next;
+    usart_rx_lost = false;
+  } else {
+    usart_rx_lost = true;
+  }
+
+  usart_update_rts();
+}
+
+#endif
+
+ISR(USART_UDRE_vect) {
+  uint8_t tail = usart_tx_tail;
+
+#if USART_FLOW_CONTROL
+  /* Wait for CTS, which will enable this interrupt again. */
+  if (usart_cts_deasserted()) {
+    UCSR0B &= ~(1 << UDRIE0);
+    return;
+  }
+#endif
+
+  UDR0 = usart_tx_buffer[tail];
+  /* Clear TXC0 by writing a one to it, so usart_flush can tell when this byte
+     has been sent. FE0, DOR0 and UPE0 must be written as zero. */
+  UCSR0A = (UCSR0A & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0);
+  tail = (tail + 1) & USART_TX_MASK;
+  usart_tx_tail = tail;
+
+  if (tail == usart_tx_head) UCSR0B &= ~(1 << UDRIE0);
+}
+
+/* API functions ----------------------------------------------------------- */
+
+void usart_init(usart_baud baud,
                 enum usart_parity parity,
                 enum usart_stop_bit_count stop_bit_count,
                 enum usart_character_size character_size) {
@@ -10,11 +181,16 @@ void usart_init(uint32_t baud_rate,
   UCSR0B = 0;
   UCSR0C = 0;
 
-  /* Baud rate */
-  if (asynchronous_mode == USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED) {
-    UCSR0A |= (1 << U2X0);
-  }
-  UBRR0 = ((F_CPU / (asynchronous_mode * baud_rate)) - 1);
+#if USART_RECEIVER
+  usart_rx_head = usart_rx_tail = 0;
+  usart_rx_lost = false;
+  usart_multiprocessor_enabled = false;
+#endif
+  usart_tx_head = usart_tx_tail = 0;
+  usart_tx_written = false;
+
+  usart_set_baud(baud);
+  usart_init_flow_control();
 
   /* Frame settings */
   UCSR0C |= (parity << 4);
@@ -25,24 +201,69 @@ void usart_init(uint32_t baud_rate,
   UCSR0C |= (character_size & (1 << 0) ? (1 << UCSZ00) : 0);
 
   /* Enable */
-  UCSR0B |= (1 << TXEN0) | (1 << RXEN0);
+  UCSR0B |= (1 << TXEN0);
+#if USART_RECEIVER
+  UCSR0B |= (1 << RXEN0) | (1 << RXCIE0);
+#endif
+}
+
+void usart_set_baud(usart_baud baud) {
+  /* Assigned rather than modified, for the same reason as in
+     usart_set_multiprocessor_mode. */
+  UCSR0A = (UCSR0A & (1 << MPCM0))
+    | ((baud & USART_BAUD_DOUBLE_SPEED_FLAG) ? (1 << U2X0) : 0);
+  UBRR0 = baud & USART_BAUD_UBRR_MASK;
+}
+
+bool usart_try_write(uint8_t byte) {
+  uint8_t head = usart_tx_head;
+  uint8_t next = (head + 1) & USART_TX_MASK;
+
+  if (next == usart_tx_tail) return false;
+
+  usart_tx_buffer[head] = byte;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_tx_head = next;
+    usart_tx_written = true;
+    UCSR0B |= (1 << UDRIE0);
+  }
+
+  return true;
 }
 
 void usart_write(uint8_t byte) {
-  while (!(UCSR0A & (1 << UDRE0)));
-  UDR0 = byte;
+  while (!usart_try_write(byte));
+}
+
+#if USART_RECEIVER
+
+bool usart_try_read(uint8_t *byte, enum usart_error *error) {
+  uint8_t tail = usart_rx_tail;
+
+  if (tail == usart_rx_head) return false;
+
+  *byte = usart_rx_buffer[tail];
+  *error = usart_rx_error_buffer[tail];
+  usart_rx_tail = (tail + 1) & USART_RX_MASK;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_update_rts();
+  }
+
+  return true;
 }
 
 uint8_t usart_read(enum usart_error *error) {
-  while (!(UCSR0A & (1 << RXC0)));
-  *error =
-    (UCSR0A & FE0 ? USART_ERROR_FRAME_ERROR : 0)
-    | (UCSR0A & DOR0 ? USART_ERROR_DATA_OVERRUN : 0)
-    | (UCSR0A & UPE0 ? USART_ERROR_PARITY_MISMATCH : 0);
-  return UDR0;
+  uint8_t byte;
+
+  while (!usart_try_read(&byte, error));
+  return byte;
 }
 
-void usart_write_bytes(uint8_t *bytes, size_t count) {
+#endif
+
+void usart_write_bytes(const uint8_t *bytes, size_t count) {
   size_t i;
 
   for (i = 0; i < count; i++) {
@@ -50,6 +271,18 @@ void usart_write_bytes(uint8_t *bytes, size_t count) {
   }
 }
 
+size_t usart_try_write_bytes(const uint8_t *bytes, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!usart_try_write(*(bytes + i))) break;
+  }
+
+  return i;
+}
+
+#if USART_RECEIVER
+
 void usart_read_bytes(uint8_t *bytes, size_t count, enum usart_error *error) {
   size_t i;
 
@@ -59,13 +292,17 @@ void usart_read_bytes(uint8_t *bytes, size_t count, enum usart_error *error) {
   }
 }
 
-void usart_write_string(char *characters) {
+#endif
+
+void usart_write_string(const char *characters) {
   while (*characters != '\0') {
     usart_write(*characters);
     characters++;
   }
 }
 
+#if USART_RECEIVER
+
 void usart_read_string(char *characters, size_t max, enum usart_error *error) {
   size_t i;
 
@@ -88,6 +325,185 @@ void usart_read_string(char *characters, size_t max, enum usart_error *error) {
   *(characters + i) = '\0';
 }
 
+void usart_multiprocessor_enable(uint8_t address) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_multiprocessor_address = address;
+    usart_multiprocessor_enabled = true;
+    usart_set_multiprocessor_mode(true);
+  }
+}
+
+void usart_multiprocessor_disable() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_multiprocessor_enabled = false;
+    usart_set_multiprocessor_mode(false);
+  }
+}
+
+#endif
+
+void usart_write_address(uint8_t address) {
+  /* The 9th bit applies to whatever is written to UDR0 next, so the
+     transmitter has to be idle while it is set. */
+  usart_flush();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    UCSR0A = (UCSR0A & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0);
+    UCSR0B |= (1 << TXB80);
+    UDR0 = address;
+    usart_tx_written = true;
+    while (!(UCSR0A & (1 << UDRE0)));
+    UCSR0B &= ~(1 << TXB80);
+  }
+}
+
+#if USART_RECEIVER
+
 bool usart_byte_available() {
-  return (UCSR0A & (1 << RXC0));
+  return usart_rx_head != usart_rx_tail;
+}
+
+uint8_t usart_bytes_available() {
+  return usart_rx_fill();
 }
+
+#endif
+
+void usart_flush() {
+  /* TXC0 is set when a frame has been sent completely while no new data is
+     waiting. */
+  if (!usart_tx_written) return;
+
+  while (usart_tx_head != usart_tx_tail);
+  while (!(UCSR0A & (1 << TXC0)));
+}
+
+#if USART_RECEIVER
+
+/* Automatic baud rate detection ----------------------------------------------
+ * Edges on the input capture pin are timestamped by timer 1, running at
+ * F_CPU. After every capture the edge is flipped, so that every edge of the
+ * sync byte is seen.
+ */
+
+static bool usart_autobaud_wait_capture(uint16_t *overflows_left) {
+  while (!(TIFR1 & (1 << ICF1))) {
+    if (TIFR1 & (1 << TOV1)) {
+      TIFR1 = (1 << TOV1);
+      if (*overflows_left == 0) return false;
+      (*overflows_left)--;
+    }
+  }
+
+  /* Flip the edge, then clear the flag that may have been set by doing so. */
+  TCCR1B ^= (1 << ICES1);
+  TIFR1 = (1 << ICF1);
+
+  return true;
+}
+
+static uint16_t usart_autobaud_error(uint16_t bit_ticks,
+                                     enum usart_asynchronous_mode mode,
+                                     uint16_t ubrr) {
+  uint16_t ticks = (uint16_t)mode * (ubrr + 1);
+  return ticks > bit_ticks ? ticks - bit_ticks : bit_ticks - ticks;
+}
+
+bool usart_autobaud(uint16_t timeout_ms, usart_baud *detected) {
+  uint16_t overflows_left =
+    ((uint32_t)timeout_ms * (F_CPU / 1000) + 0xFFFF) >> 16;
+  uint16_t previous = 0, capture, interval;
+  uint16_t shortest = 0xFFFF;
+  uint16_t normal_ubrr, double_ubrr;
+  usart_baud baud;
+  uint8_t edge;
+  uint8_t saved_tccr1a, saved_tccr1b, saved_timsk1, saved_ddrb;
+  uint16_t saved_tcnt1;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    saved_tccr1a = TCCR1A;
+    saved_tccr1b = TCCR1B;
+    saved_timsk1 = TIMSK1;
+    saved_tcnt1 = TCNT1;
+  }
+  saved_ddrb = DDRB & (1 << PORTB0);
+
+  DDRB &= ~(1 << PORTB0);         /* ICP1: Input Capture */
+
+  timer1_init(TIMER_WAVE_TYPE_NORMAL,
+              TIMER_WRAP_TYPE_16_BITS,
+              TIMER_CLOCK_SOURCE_DIV_1,
+              TIMER_INTERRUPT_OFF,
+              TIMER_COMPARE_OUTPUT_MODE_OFF,
+              TIMER_COMPARE_OUTPUT_MODE_OFF,
+              TIMER_INPUT_CAPTURE_EDGE_FALLING,
+              TIMER_INPUT_CAPTURE_NOISE_CANCELER_DISABLED);
+  TIFR1 = (1 << ICF1) | (1 << TOV1);
+
+  for (edge = 0; edge < USART_AUTOBAUD_EDGES; edge++) {
+    /* Only the wait for the start bit is bounded by the timeout. After that,
+       the line is expected to keep changing, and a single timer overflow is
+       allowed between edges. */
+    if (edge > 0) overflows_left = 1;
+
+    if (!usart_autobaud_wait_capture(&overflows_left)) break;
+    capture = TIMER1_INPUT_CAPTURE;
+
+    if (edge > 0) {
+      interval = capture - previous;
+      if (interval < shortest) shortest = interval;
+    }
+    previous = capture;
+  }
+
+  /* Put timer 1 back the way it was, for whoever else uses it. The flags
+     set while measuring are cleared, so they do not trigger its
+     interrupts. */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    TCCR1B = 0;
+    TCNT1 = saved_tcnt1;
+    TCCR1A = saved_tccr1a;
+    TIFR1 = (1 << ICF1) | (1 << OCF1B) | (1 << OCF1A) | (1 << TOV1);
+    TIMSK1 = saved_timsk1;
+    TCCR1B = saved_tccr1b;
+  }
+  DDRB |= saved_ddrb;
+
+  if (edge < USART_AUTOBAUD_EDGES) return false;
+
+  /* Pick the mode whose rounded register value is closest to the measured bit
+     time, preferring normal speed. */
+  normal_ubrr = (shortest + USART_ASYNCHRONOUS_MODE_NORMAL_SPEED / 2)
+    / USART_ASYNCHRONOUS_MODE_NORMAL_SPEED;
+  double_ubrr = (shortest + USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED / 2)
+    / USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED;
+  if (normal_ubrr > 0) normal_ubrr--;
+  if (double_ubrr > 0) double_ubrr--;
+
+  if (double_ubrr <= USART_BAUD_UBRR_MASK
+      && usart_autobaud_error(shortest,
+                              USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED,
+                              double_ubrr)
+      < usart_autobaud_error(shortest,
+                             USART_ASYNCHRONOUS_MODE_NORMAL_SPEED,
+                             normal_ubrr)) {
+    baud = double_ubrr | USART_BAUD_DOUBLE_SPEED_FLAG;
+  } else {
+    baud = normal_ubrr;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_set_baud(baud);
+
+    /* Whatever was received while measuring is garbage. */
+    while (UCSR0A & (1 << RXC0)) (void)UDR0;
+    usart_rx_head = usart_rx_tail = 0;
+    usart_rx_lost = false;
+    usart_update_rts();
+  }
+
+  if (detected) *detected = baud;
+  return true;
+}
+
+#endif
@@ -4,7 +4,14 @@
  * following limitations:
  *
  * - It only supports asynchronous operation
- * - It does not support 9-bit characters
+ * - 9-bit characters are only supported for multi-processor communication,
+ *   where the 9th bit marks address frames
+ *
+ * Reception and transmission are interrupt driven: received bytes are stored
+ * in a ring buffer until they are read, and written bytes are stored in
+ * another one until they can be sent. Note that this does not globally enable
+ * interrupts using sei(), which you will have to do for the library to
+ * function.
  */
 
 #ifndef PLEASANT_USART_H
@@ -24,6 +31,67 @@ enum usart_asynchronous_mode {
   USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED = 8
 };
 
+/* Baud rate ------------------------------------------------------------------
+ * The baud rate is passed to usart_init as a usart_baud value, which holds
+ * both the value of the baud rate register and whether double speed is used.
+ * It should be computed using USART_BAUD, which does all of the work at
+ * compile time: it picks the asynchronous mode giving the smallest error, and
+ * rounds the register value to the nearest one.
+ *
+ * If the error for a baud rate exceeds USART_BAUD_TOLERANCE (in tenths of a
+ * percent), the build fails with an error about an array with a negative
+ * size. The baud rate passed to USART_BAUD must be a constant.
+ *
+ * USART_BAUD_WITH_MODE can be used to force a specific asynchronous mode. It
+ * performs the same check.
+ */
+
+typedef uint16_t usart_baud;
+
+#ifndef USART_BAUD_TOLERANCE
+#define USART_BAUD_TOLERANCE 25
+#endif
+
+#define USART_BAUD_DOUBLE_SPEED_FLAG 0x8000
+#define USART_BAUD_UBRR_MASK         0x0FFF
+
+#define USART_BAUD_UBRR(baud_rate, mode)                                      \
+  (((F_CPU) + (uint32_t)(mode) * (baud_rate) / 2)                             \
+   / ((uint32_t)(mode) * (baud_rate)) - 1)
+
+#define USART_BAUD_ACTUAL(baud_rate, mode)                                    \
+  ((F_CPU) / ((uint32_t)(mode) * (USART_BAUD_UBRR(baud_rate, mode) + 1)))
+
+#define USART_BAUD_ERROR(baud_rate, mode)                                     \
+  ((USART_BAUD_ACTUAL(baud_rate, mode) > (uint32_t)(baud_rate)                \
+    ? USART_BAUD_ACTUAL(baud_rate, mode) - (baud_rate)                        \
+    : (baud_rate) - USART_BAUD_ACTUAL(baud_rate, mode))                       \
+   * 1000 / (baud_rate))
+
+#define USART_BAUD_USE_DOUBLE_SPEED(baud_rate)                                \
+  (USART_BAUD_UBRR(baud_rate, USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED)           \
+   <= USART_BAUD_UBRR_MASK                                                    \
+   && USART_BAUD_ERROR(baud_rate, USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED)       \
+   < USART_BAUD_ERROR(baud_rate, USART_ASYNCHRONOUS_MODE_NORMAL_SPEED))
+
+#define USART_BAUD_WITH_MODE(baud_rate, mode)                                 \
+  ((usart_baud)                                                               \
+   (USART_BAUD_UBRR(baud_rate, mode)                                          \
+    | ((mode) == USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED                         \
+       ? USART_BAUD_DOUBLE_SPEED_FLAG : 0)                                    \
+    | 0 * sizeof(char[(USART_BAUD_UBRR(baud_rate, mode)                       \
+                       <= USART_BAUD_UBRR_MASK)                               \
+                      && (USART_BAUD_ERROR(baud_rate, mode)                   \
+                          <= USART_BAUD_TOLERANCE) ? 1 : -1])))
+
+#define USART_BAUD_MODE(baud_rate)                                            \
+  (USART_BAUD_USE_DOUBLE_SPEED(baud_rate)                                     \
+   ? USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED                                     \
+   : USART_ASYNCHRONOUS_MODE_NORMAL_SPEED)
+
+#define USART_BAUD(baud_rate)                                                 \
+  USART_BAUD_WITH_MODE(baud_rate, USART_BAUD_MODE(baud_rate))
+
 /* Parity ---------------------------------------------------------------------
  * The USART can both generate and check a parity bit for each frame.
  */
@@ -43,20 +111,37 @@ enum usart_stop_bit_count {
 };
 
 /* Character size -------------------------------------------------------------
- * USART can work with characters of sizes from 5 to 9 bits. Pleasant USART
- * does not support 9-bit characters.
+ * USART can work with characters of sizes from 5 to 9 bits. 9-bit characters
+ * are meant for multi-processor communication, and only the lower 8 bits of
+ * data frames are stored.
  */
 enum usart_character_size {
   USART_CHARACTER_SIZE_5_BITS = 0,
   USART_CHARACTER_SIZE_6_BITS = 1,
   USART_CHARACTER_SIZE_7_BITS = 2,
-  USART_CHARACTER_SIZE_8_BITS = 3
-  /* 9-bit characters not supported. */
+  USART_CHARACTER_SIZE_8_BITS = 3,
+  USART_CHARACTER_SIZE_9_BITS = 7
 };
 
+/* Multi-processor communication ----------------------------------------------
+ * Many devices can share a single bus, using 9-bit characters. A frame with
+ * the 9th bit set addresses a device, and the frames with the 9th bit cleared
+ * that follow it are meant for that device only.
+ *
+ * Once an address has been set, the hardware ignores all data frames until
+ * the device is addressed, so no interrupts are taken for traffic meant for
+ * others. The address frames themselves are handled inside the receive
+ * interrupt, and are not stored in the receive buffer.
+ */
+
 /* Errors ---------------------------------------------------------------------
  * Various errors can occur while receiving data. They will be indicated
  * through a bitwise OR of 0 or more of the following values.
+ *
+ * The errors detected for a byte are stored along with it in the receive
+ * buffer, and reported when that byte is read. When bytes were lost because
+ * the receive buffer was full, a data overrun is reported for the first byte
+ * stored after them.
  */
 
 enum usart_error {
@@ -66,39 +151,177 @@ enum usart_error {
   USART_ERROR_PARITY_MISMATCH = 4
 };
 
+/* Buffers --------------------------------------------------------------------
+ * The sizes of the receive and transmit buffers. They have to be powers of
+ * two, no larger than 128. Every entry of the receive buffer also holds the
+ * errors of its byte, so it takes twice the memory.
+ */
+
+#define USART_RX_BUFFER_SIZE 64
+#define USART_TX_BUFFER_SIZE 64
+
+/* Receiver -------------------------------------------------------------------
+ * Firmware that only sends data can define USART_RECEIVER as 0 when building
+ * Pleasant USART. The receiver, its interrupt and its buffer are then left
+ * out, along with every function that receives data. Flow control needs the
+ * receiver.
+ */
+
+#ifndef USART_RECEIVER
+#define USART_RECEIVER 1
+#endif
+
+/* Flow control ---------------------------------------------------------------
+ * RTS/CTS hardware flow control can be enabled by defining USART_FLOW_CONTROL
+ * as 1 when building Pleasant USART.
+ *
+ * RTS is an output, driven high to ask the other side to stop sending once
+ * the receive buffer holds USART_RTS_HIGH_WATERMARK bytes, and driven low
+ * again once reading has brought it down to USART_RTS_LOW_WATERMARK bytes. The
+ * space above the high watermark has to be enough to hold the bytes the other
+ * side sends before it reacts.
+ *
+ * CTS is an input on D2 (INT0), with its pull-up enabled. While it is high, no
+ * new bytes are sent. External interrupt 0 resumes sending when it goes low.
+ */
+
+#ifndef USART_FLOW_CONTROL
+#define USART_FLOW_CONTROL 0
+#endif
+
+#ifndef USART_RTS_DDR
+#define USART_RTS_DDR DDRD
+#endif
+
+#ifndef USART_RTS_PORT
+#define USART_RTS_PORT PORTD
+#endif
+
+#ifndef USART_RTS_PIN
+#define USART_RTS_PIN PORTD3
+#endif
+
+#ifndef USART_RTS_HIGH_WATERMARK
+#define USART_RTS_HIGH_WATERMARK (USART_RX_BUFFER_SIZE - 16)
+#endif
+
+#ifndef USART_RTS_LOW_WATERMARK
+#define USART_RTS_LOW_WATERMARK (USART_RX_BUFFER_SIZE / 4)
+#endif
+
 /* Defaults ---------------------------------------------------------------- */
 
-#define USART_DEFAULT_ASYNCHRONOUS_MODE USART_ASYNCHRONOUS_MODE_DOUBLE_SPEED
 #define USART_DEFAULT_PARITY            USART_PARITY_DISABLED
 #define USART_DEFAULT_STOP_BIT_COUNT    USART_STOP_BIT_COUNT_1_BIT
 #define USART_DEFAULT_CHARACTER_SIZE    USART_CHARACTER_SIZE_8_BITS
 
+/* Automatic baud rate detection ----------------------------------------------
+ * The baud rate can be detected from a sync byte sent by the other side. This
+ * uses timer 1's input capture to measure the time between edges on the RX
+ * line, so RX (D0) also has to be connected to the input capture pin ICP1
+ * (B0). The shortest time between USART_AUTOBAUD_EDGES edges is taken as the
+ * bit time. The sync byte should be 0x55 ('U'), whose frame changes level on
+ * every bit, giving exactly that many edges. Other bytes have fewer edges,
+ * so the measurement would run into the next byte, and may not see a single
+ * bit on its own.
+ *
+ * Edges are timestamped by polling, so this works up to roughly 250000 baud
+ * at 16 MHz. Timer 1 and the direction of B0 are restored afterwards, but
+ * timer 1 does not count while the measurement runs. B0 is also the reset
+ * line of the display driven by Pleasant LCD, so the two can not be used on
+ * the same board.
+ */
+
+#define USART_AUTOBAUD_EDGES 10
+
+/* Callbacks ------------------------------------------------------------------
+ * Instead of storing received bytes in the receive buffer, they can be handed
+ * to a function directly. This allows protocols to be decoded as bytes
+ * arrive.
+ */
+
+#if USART_RECEIVER
+
+/*
+ * Function called from the receive interrupt for every byte received, along
+ * with any errors detected for that byte. While it is set, the receive buffer
+ * is not used.
+ */
+extern void (*usart_receive_callback)(uint8_t byte, enum usart_error error);
+
+#endif
+
 /* API functions ----------------------------------------------------------- */
 
 /*
- * Configure the USART's various settings. For all but the baud rate, suggested
- * settings are USART_DEFAULT_*.
+ * Configure the USART's various settings. The baud rate should be computed
+ * using USART_BAUD. For the other settings, suggested values are
+ * USART_DEFAULT_*. Both buffers are emptied.
  */
-void usart_init(uint32_t baud_rate,
-                enum usart_asynchronous_mode asynchronous_mode,
+void usart_init(usart_baud baud,
                 enum usart_parity parity,
                 enum usart_stop_bit_count stop_bit_count,
                 enum usart_character_size character_size);
 
 /*
- * Write a single byte to the USART.
+ * Change the baud rate, leaving all other settings as they are.
+ */
+void usart_set_baud(usart_baud baud);
+
+#if USART_RECEIVER
+
+/*
+ * Detect the baud rate from a sync byte, and change the baud rate to match.
+ * The USART should have been initialized before. If no sync byte starts
+ * within timeout_ms milliseconds, false is returned and nothing is changed.
+ * Otherwise the detected setting is stored in detected, unless it is NULL.
+ * The receive buffer is emptied.
+ */
+bool usart_autobaud(uint16_t timeout_ms, usart_baud *detected);
+
+#endif
+
+/*
+ * Write a single byte to the USART. If the transmit buffer is full, this waits
+ * until there is space.
  */
 void usart_write(uint8_t byte);
 
 /*
- * Read a single byte from the USART.
+ * Write a single byte to the USART if there is space in the transmit buffer.
+ * Returns false, without writing, if the buffer is full.
+ */
+bool usart_try_write(uint8_t byte);
+
+#if USART_RECEIVER
+
+/*
+ * Read a single byte from the USART. If the receive buffer is empty, this
+ * waits until a byte is received.
  */
 uint8_t usart_read(enum usart_error *error);
 
 /*
- * Write a number of bytes to the USART.
+ * Read a single byte from the USART if one is available. Returns false, without
+ * touching byte or error, if the receive buffer is empty.
  */
-void usart_write_bytes(uint8_t *bytes, size_t count);
+bool usart_try_read(uint8_t *byte, enum usart_error *error);
+
+#endif
+
+/*
+ * Write a number of bytes to the USART, waiting for space in the transmit
+ * buffer as needed.
+ */
+void usart_write_bytes(const uint8_t *bytes, size_t count);
+
+/*
+ * Write as many of the bytes as fit into the transmit buffer, without waiting.
+ * Returns the number of bytes written.
+ */
+size_t usart_try_write_bytes(const uint8_t *bytes, size_t count);
+
+#if USART_RECEIVER
 
 /*
  * Read a number of bytes from the USART. Will return when count bytes have
@@ -106,11 +329,15 @@ void usart_write_bytes(uint8_t *bytes, size_t count);
  */
 void usart_read_bytes(uint8_t *bytes, size_t count, enum usart_error *error);
 
+#endif
+
 /*
  * Write a string to the USART. Writing will end before the first \0
  * encountered.
  */
-void usart_write_string(char *characters);
+void usart_write_string(const char *characters);
+
+#if USART_RECEIVER
 
 /*
  * Read a string from the USART. Will read up to max-1 characters, or until the
@@ -124,9 +351,44 @@ void usart_write_string(char *characters);
  */
 void usart_read_string(char *characters, size_t max, enum usart_error *error);
 
+/*
+ * Enable multi-processor communication mode, listening on the specified
+ * address. The USART should have been initialized with
+ * USART_CHARACTER_SIZE_9_BITS.
+ */
+void usart_multiprocessor_enable(uint8_t address);
+
+/*
+ * Disable multi-processor communication mode, receiving all frames again.
+ */
+void usart_multiprocessor_disable();
+
+#endif
+
+/*
+ * Send an address frame, selecting the device with that address. This waits
+ * until all bytes written before have been sent. Bytes written afterwards are
+ * sent as data frames.
+ */
+void usart_write_address(uint8_t address);
+
+#if USART_RECEIVER
+
 /*
  * Check if a byte is available from the USART.
  */
 bool usart_byte_available();
 
+/*
+ * Return the number of bytes in the receive buffer.
+ */
+uint8_t usart_bytes_available();
+
+#endif
+
+/*
+ * Wait until all bytes in the transmit buffer have been sent completely.
+ */
+void usart_flush();
+
 #endif /* PLEASANT_USART_H */